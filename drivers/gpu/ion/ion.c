@@ -15,6 +15,7 @@
  */
 
 #include <linux/device.h>
+#include <linux/dma-buf.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
@@ -60,7 +61,10 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
-/* this function should only be called while dev->lock is held */
+/*
+ * allocates from the heap under its own lock, dev->lock is only taken to
+ * add the new buffer to the device
+ */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -68,6 +72,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     unsigned long flags)
 {
 	struct ion_buffer *buffer;
+	ktime_t start = ktime_get();
 	int ret;
 
 	buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
@@ -77,29 +82,136 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->heap = heap;
 	kref_init(&buffer->ref);
 
+	mutex_lock(&heap->lock);
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	/* buffers waiting to be freed may hold the memory we need */
+	if (ret && ion_heap_freelist_drain(heap, 0))
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	mutex_unlock(&heap->lock);
 	if (ret) {
+		ion_heap_stats_fail(heap, start);
 		kfree(buffer);
 		return ERR_PTR(ret);
 	}
+	/* heaps that size their buffers themselves account for them */
+	if (len)
+		ion_heap_stats_alloc(heap, len, start);
 	buffer->dev = dev;
 	buffer->size = len;
 	buffer->cached = false;
 	mutex_init(&buffer->lock);
+	INIT_LIST_HEAD(&buffer->kmap_lru);
+	mutex_lock(&dev->lock);
 	ion_buffer_add(dev, buffer);
+	mutex_unlock(&dev->lock);
 	return buffer;
 }
 
+/*
+ * Kernel mappings are not torn down when the last user unmaps them.  The
+ * buffer goes on an lru instead, and the next map of the buffer reuses the
+ * mapping.  The least recently used mappings are released once the unused
+ * ones take up more than ION_KMAP_CACHE_MAX of vmalloc space.
+ *
+ * Lock order is buffer->lock, then dev->kmap_lock.
+ */
+#define ION_KMAP_CACHE_MAX	(32 << 20)
+
+/* buffer->lock must be held, called when kmap_cnt goes from 0 to 1 */
+static void *ion_buffer_kmap_create(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+
+	mutex_lock(&dev->kmap_lock);
+	if (!list_empty(&buffer->kmap_lru)) {
+		list_del_init(&buffer->kmap_lru);
+		dev->kmap_lru_size -= buffer->size;
+		dev->kmap_hits++;
+		mutex_unlock(&dev->kmap_lock);
+		return buffer->vaddr;
+	}
+	dev->kmap_misses++;
+	mutex_unlock(&dev->kmap_lock);
+
+	return buffer->heap->ops->map_kernel(buffer->heap, buffer);
+}
+
+/* buffer->lock must be held, called when kmap_cnt drops to 0 */
+static void ion_buffer_kmap_release(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+
+	mutex_lock(&dev->kmap_lock);
+	list_add_tail(&buffer->kmap_lru, &dev->kmap_lru);
+	dev->kmap_lru_size += buffer->size;
+	mutex_unlock(&dev->kmap_lock);
+}
+
+/* must be called without any buffer->lock held */
+static void ion_kmap_cache_trim(struct ion_device *dev)
+{
+	struct ion_buffer *buffer, *tmp;
+
+	mutex_lock(&dev->kmap_lock);
+	list_for_each_entry_safe(buffer, tmp, &dev->kmap_lru, kmap_lru) {
+		if (dev->kmap_lru_size <= ION_KMAP_CACHE_MAX)
+			break;
+		/* busy, possibly about to reuse its mapping */
+		if (!mutex_trylock(&buffer->lock))
+			continue;
+		list_del_init(&buffer->kmap_lru);
+		dev->kmap_lru_size -= buffer->size;
+		dev->kmap_evictions++;
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+		buffer->vaddr = NULL;
+		mutex_unlock(&buffer->lock);
+	}
+	mutex_unlock(&dev->kmap_lock);
+}
+
+/* drop the cached mapping of a buffer about to be freed */
+static void ion_kmap_cache_remove(struct ion_buffer *buffer)
+{
+	struct ion_device *dev = buffer->dev;
+	bool cached;
+
+	mutex_lock(&dev->kmap_lock);
+	cached = !list_empty(&buffer->kmap_lru);
+	if (cached) {
+		list_del_init(&buffer->kmap_lru);
+		dev->kmap_lru_size -= buffer->size;
+	}
+	mutex_unlock(&dev->kmap_lock);
+
+	if (cached) {
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+		buffer->vaddr = NULL;
+	}
+}
+
+void ion_buffer_free(struct ion_buffer *buffer)
+{
+	ion_kmap_cache_remove(buffer);
+	ion_heap_stats_free(buffer->heap, buffer->size);
+	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
 static void ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
+	struct ion_heap *heap = buffer->heap;
 
-	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	/* don't stall the caller freeing large buffers if we can help it */
+	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    ion_heap_freelist_add(heap, buffer))
+		return;
+	ion_buffer_free(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -225,7 +337,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	 * request of the caller allocate from it.  Repeat until allocate has
 	 * succeeded or all heaps have been tried
 	 */
-	mutex_lock(&dev->lock);
+	down_read(&dev->heap_lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		/* if the client doesn't support this heap type */
@@ -238,7 +350,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->heap_lock);
 
 	if (IS_ERR_OR_NULL(buffer))
 		return ERR_PTR(PTR_ERR(buffer));
@@ -366,7 +478,7 @@ void *ion_map_kernel(struct ion_client *client, struct ion_handle *handle)
 	}
 
 	if (_ion_map(&buffer->kmap_cnt, &handle->kmap_cnt)) {
-		vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
+		vaddr = ion_buffer_kmap_create(buffer);
 		if (IS_ERR_OR_NULL(vaddr))
 			_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt);
 		buffer->vaddr = vaddr;
@@ -423,12 +535,11 @@ void ion_unmap_kernel(struct ion_client *client, struct ion_handle *handle)
 	mutex_lock(&client->lock);
 	buffer = handle->buffer;
 	mutex_lock(&buffer->lock);
-	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt)) {
-		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
-		buffer->vaddr = NULL;
-	}
+	if (_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt))
+		ion_buffer_kmap_release(buffer);
 	mutex_unlock(&buffer->lock);
 	mutex_unlock(&client->lock);
+	ion_kmap_cache_trim(client->dev);
 }
 EXPORT_SYMBOL(ion_unmap_kernel);
 
@@ -492,24 +603,270 @@ end:
 }
 EXPORT_SYMBOL(ion_import);
 
+/*
+ * the sg_table of an attachment only depends on the buffer, so it is built
+ * on the first map and kept until the attachment goes away
+ */
+static struct sg_table *ion_map_dma_buf(struct dma_buf_attachment *attachment,
+					enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = attachment->dmabuf->priv;
+	struct sg_table *table;
+
+	mutex_lock(&buffer->lock);
+	table = attachment->priv;
+	if (!table) {
+		table = buffer->heap->ops->map_dma_buf(buffer->heap, buffer,
+						       attachment->dev);
+		if (IS_ERR_OR_NULL(table))
+			table = table ? table : ERR_PTR(-ENOMEM);
+		else
+			attachment->priv = table;
+	}
+	mutex_unlock(&buffer->lock);
+	return table;
+}
+
+static void ion_unmap_dma_buf(struct dma_buf_attachment *attachment,
+			      struct sg_table *table,
+			      enum dma_data_direction direction)
+{
+}
+
+static void ion_dma_buf_detach(struct dma_buf *dmabuf,
+			       struct dma_buf_attachment *attachment)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	if (attachment->priv)
+		buffer->heap->ops->unmap_dma_buf(buffer->heap, buffer,
+						 attachment->priv);
+}
+
+static void ion_dma_buf_release(struct dma_buf *dmabuf)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	ion_buffer_put(buffer);
+}
+
+/* buffer->lock must be held */
+static void *ion_buffer_kmap_get(struct ion_buffer *buffer)
+{
+	void *vaddr;
+
+	if (buffer->kmap_cnt) {
+		buffer->kmap_cnt++;
+		return buffer->vaddr;
+	}
+	if (!buffer->heap->ops->map_kernel)
+		return NULL;
+	vaddr = ion_buffer_kmap_create(buffer);
+	if (IS_ERR_OR_NULL(vaddr))
+		return NULL;
+	buffer->vaddr = vaddr;
+	buffer->kmap_cnt++;
+	return vaddr;
+}
+
+/* buffer->lock must be held */
+static void ion_buffer_kmap_put(struct ion_buffer *buffer)
+{
+	if (!--buffer->kmap_cnt)
+		ion_buffer_kmap_release(buffer);
+}
+
+static int ion_dma_buf_sync(struct ion_buffer *buffer, size_t start,
+			    size_t len, enum cache_operation op)
+{
+	struct ion_cache_range range = { .offset = start, .len = len };
+
+	if (!buffer->cached || !buffer->kmap_cnt ||
+	    !buffer->heap->ops->sync_user)
+		return 0;
+	if (start + len < start || start + len > buffer->size)
+		return -EINVAL;
+	return buffer->heap->ops->sync_user(buffer,
+					    (unsigned long)buffer->vaddr,
+					    &range, 1, op);
+}
+
+/*
+ * cpu access goes through the kernel mapping, which is held from begin to
+ * end so that kmap() and kmap_atomic() can simply index into it.  Heaps
+ * without a kernel mapping only get no cache maintenance.
+ */
+static int ion_dma_buf_begin_cpu_access(struct dma_buf *dmabuf, size_t start,
+					size_t len,
+					enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+	int ret = 0;
+
+	mutex_lock(&buffer->lock);
+	if (ion_buffer_kmap_get(buffer) && direction != DMA_TO_DEVICE) {
+		ret = ion_dma_buf_sync(buffer, start, len, CACHE_INVALIDATE);
+		if (ret)
+			ion_buffer_kmap_put(buffer);
+	}
+	mutex_unlock(&buffer->lock);
+	return ret;
+}
+
+static void ion_dma_buf_end_cpu_access(struct dma_buf *dmabuf, size_t start,
+				       size_t len,
+				       enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	mutex_lock(&buffer->lock);
+	if (buffer->kmap_cnt) {
+		if (direction != DMA_FROM_DEVICE &&
+		    ion_dma_buf_sync(buffer, start, len, CACHE_CLEAN))
+			pr_err("%s: failure cleaning buffer\n", __func__);
+		ion_buffer_kmap_put(buffer);
+	}
+	mutex_unlock(&buffer->lock);
+	ion_kmap_cache_trim(buffer->dev);
+}
+
+/* only valid between begin_cpu_access and end_cpu_access */
+static void *ion_dma_buf_kmap(struct dma_buf *dmabuf, unsigned long offset)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	if (!buffer->kmap_cnt)
+		return NULL;
+	return buffer->vaddr + offset * PAGE_SIZE;
+}
+
+static void ion_dma_buf_kunmap(struct dma_buf *dmabuf, unsigned long offset,
+			       void *ptr)
+{
+}
+
+/* no callbacks, it only marks the vma as a mapping of vm_private_data */
+static const struct vm_operations_struct ion_dma_buf_vm_ops;
+
+static int ion_dma_buf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!buffer->heap->ops->map_user) {
+		pr_err("%s: this heap does not define a method for mapping "
+		       "to userspace\n", __func__);
+		return -EINVAL;
+	}
+	if (size + (vma->vm_pgoff << PAGE_SHIFT) > buffer->size)
+		return -EINVAL;
+
+	mutex_lock(&buffer->lock);
+	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+	mutex_unlock(&buffer->lock);
+	if (ret) {
+		pr_err("%s: failure mapping buffer to userspace\n", __func__);
+		return ret;
+	}
+
+	vma->vm_ops = &ion_dma_buf_vm_ops;
+	vma->vm_private_data = buffer;
+	return 0;
+}
+
+static const struct dma_buf_ops ion_dma_buf_ops = {
+	.detach = ion_dma_buf_detach,
+	.map_dma_buf = ion_map_dma_buf,
+	.unmap_dma_buf = ion_unmap_dma_buf,
+	.release = ion_dma_buf_release,
+	.begin_cpu_access = ion_dma_buf_begin_cpu_access,
+	.end_cpu_access = ion_dma_buf_end_cpu_access,
+	.kmap_atomic = ion_dma_buf_kmap,
+	.kunmap_atomic = ion_dma_buf_kunmap,
+	.kmap = ion_dma_buf_kmap,
+	.kunmap = ion_dma_buf_kunmap,
+	.mmap = ion_dma_buf_mmap,
+};
+
+struct dma_buf *ion_share_dma_buf(struct ion_client *client,
+				  struct ion_handle *handle)
+{
+	struct ion_buffer *buffer;
+	struct dma_buf *dmabuf;
+	bool valid_handle;
+
+	mutex_lock(&client->lock);
+	valid_handle = ion_handle_validate(client, handle);
+	mutex_unlock(&client->lock);
+	if (!valid_handle) {
+		pr_err("%s: invalid handle passed to share.\n", __func__);
+		return ERR_PTR(-EINVAL);
+	}
+
+	buffer = handle->buffer;
+	if (!buffer->heap->ops->map_dma_buf) {
+		pr_err("%s: this heap does not support dma-buf\n", __func__);
+		return ERR_PTR(-ENODEV);
+	}
+
+	/* the dma-buf holds a reference for as long as it exists */
+	ion_buffer_get(buffer);
+	dmabuf = dma_buf_export(buffer, &ion_dma_buf_ops, buffer->size,
+				O_RDWR);
+	if (IS_ERR(dmabuf))
+		ion_buffer_put(buffer);
+	return dmabuf;
+}
+EXPORT_SYMBOL(ion_share_dma_buf);
+
+int ion_share_dma_buf_fd(struct ion_client *client, struct ion_handle *handle)
+{
+	struct dma_buf *dmabuf;
+	int fd;
+
+	dmabuf = ion_share_dma_buf(client, handle);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0)
+		dma_buf_put(dmabuf);
+	return fd;
+}
+EXPORT_SYMBOL(ion_share_dma_buf_fd);
+
 static const struct file_operations ion_share_fops;
 
 struct ion_handle *ion_import_fd(struct ion_client *client, int fd)
 {
 	struct file *file = fget(fd);
 	struct ion_handle *handle;
+	struct dma_buf *dmabuf;
 
 	if (!file) {
 		pr_err("%s: imported fd not found in file table.\n", __func__);
 		return ERR_PTR(-EINVAL);
 	}
-	if (file->f_op != &ion_share_fops) {
-		pr_err("%s: imported file is not a shared ion file.\n",
-		       __func__);
-		handle = ERR_PTR(-EINVAL);
+	if (file->f_op == &ion_share_fops) {
+		handle = ion_import(client, file->private_data);
 		goto end;
 	}
-	handle = ion_import(client, file->private_data);
+
+	/* a dma-buf we exported ourselves */
+	dmabuf = dma_buf_get(fd);
+	if (!IS_ERR(dmabuf)) {
+		bool ours = dmabuf->ops == &ion_dma_buf_ops;
+
+		if (ours)
+			handle = ion_import(client, dmabuf->priv);
+		dma_buf_put(dmabuf);
+		if (ours)
+			goto end;
+	}
+
+	pr_err("%s: imported file is not a shared ion file.\n", __func__);
+	handle = ERR_PTR(-EINVAL);
 end:
 	fput(file);
 	return handle;
@@ -846,9 +1203,54 @@ err:
 	return ret;
 }
 
+/* true if vma maps buffer, through a share fd or through a dma-buf */
+static bool ion_vma_maps_buffer(struct vm_area_struct *vma,
+				struct ion_buffer *buffer)
+{
+	if (vma->vm_ops == &ion_vm_ops)
+		return vma->vm_file->private_data == buffer;
+	if (vma->vm_ops == &ion_dma_buf_vm_ops)
+		return vma->vm_private_data == buffer;
+	return false;
+}
+
+/*
+ * The cache ioctls take a user address, and the dmac primitives would clean
+ * or invalidate a kernel address as readily and have no fault fixup.  Each
+ * range must lie in one of the process' own mappings of the buffer, which
+ * the caller keeps in place by holding mmap_sem for reading until the
+ * maintenance is done.  mmap_sem is taken before client->lock and
+ * buffer->lock, the order mmap() takes them in.
+ */
+static int ion_check_user_ranges(struct ion_buffer *buffer,
+				 unsigned long vaddr,
+				 struct ion_cache_range *ranges,
+				 unsigned int nr)
+{
+	struct vm_area_struct *vma;
+	unsigned long start, end;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!ranges[i].len)
+			continue;
+		start = vaddr + ranges[i].offset;
+		end = start + ranges[i].len;
+		if (start < vaddr || end < start || end > TASK_SIZE ||
+		    !access_ok(VERIFY_READ, start, ranges[i].len))
+			return -EFAULT;
+		vma = find_vma(current->mm, start);
+		if (!vma || vma->vm_start > start || end > vma->vm_end ||
+		    !ion_vma_maps_buffer(vma, buffer))
+			return -EFAULT;
+	}
+	return 0;
+}
+
 static int ion_flush_cached(struct ion_handle *handle, size_t size,
 			   unsigned long vaddr)
 {
+	struct ion_cache_range range = { .offset = 0, .len = size };
 	struct ion_buffer *buffer;
 	int ret = -EINVAL;
 
@@ -859,6 +1261,11 @@ static int ion_flush_cached(struct ion_handle *handle, size_t size,
 	}
 
 	buffer = handle->buffer;
+	if (size > buffer->size)
+		return -EINVAL;
+	ret = ion_check_user_ranges(buffer, vaddr, &range, 1);
+	if (ret)
+		return ret;
 
 	mutex_lock(&buffer->lock);
 	/* now flush buffer mapped to userspace */
@@ -874,6 +1281,7 @@ static int ion_flush_cached(struct ion_handle *handle, size_t size,
 static int ion_inval_cached(struct ion_handle *handle, size_t size,
 			   unsigned long vaddr)
 {
+	struct ion_cache_range range = { .offset = 0, .len = size };
 	struct ion_buffer *buffer;
 	int ret = -EINVAL;
 
@@ -884,6 +1292,11 @@ static int ion_inval_cached(struct ion_handle *handle, size_t size,
 	}
 
 	buffer = handle->buffer;
+	if (size > buffer->size)
+		return -EINVAL;
+	ret = ion_check_user_ranges(buffer, vaddr, &range, 1);
+	if (ret)
+		return ret;
 
 	mutex_lock(&buffer->lock);
 	/* now flush buffer mapped to userspace */
@@ -896,6 +1309,41 @@ static int ion_inval_cached(struct ion_handle *handle, size_t size,
 	return ret;
 }
 
+static int ion_sync_cached(struct ion_handle *handle, unsigned long vaddr,
+			   struct ion_cache_range *ranges, unsigned int nr,
+			   unsigned int op)
+{
+	struct ion_buffer *buffer = handle->buffer;
+	unsigned int i;
+	int ret;
+
+	if (!buffer->heap->ops->sync_user) {
+		pr_err("%s: this heap does not define a method for syncing\n",
+				__func__);
+		return -EINVAL;
+	}
+
+	if (op > CACHE_FLUSH)
+		return -EINVAL;
+
+	for (i = 0; i < nr; i++) {
+		if (ranges[i].offset + ranges[i].len < ranges[i].offset ||
+		    ranges[i].offset + ranges[i].len > buffer->size)
+			return -EINVAL;
+	}
+	ret = ion_check_user_ranges(buffer, vaddr, ranges, nr);
+	if (ret)
+		return ret;
+
+	mutex_lock(&buffer->lock);
+	ret = buffer->heap->ops->sync_user(buffer, vaddr, ranges, nr, op);
+	mutex_unlock(&buffer->lock);
+	if (ret)
+		pr_err("%s: failure syncing buffer\n", __func__);
+
+	return ret;
+}
+
 static const struct file_operations ion_share_fops = {
 	.owner		= THIS_MODULE,
 	.release	= ion_share_release,
@@ -981,6 +1429,19 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			return -EFAULT;
 		break;
 	}
+	case ION_IOC_SHARE_DMABUF:
+	{
+		struct ion_fd_data data;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		data.fd = ion_share_dma_buf_fd(client, data.handle);
+		if (data.fd < 0)
+			return data.fd;
+		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+			return -EFAULT;
+		break;
+	}
 	case ION_IOC_IMPORT:
 	{
 		struct ion_fd_data data;
@@ -1016,16 +1477,19 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
+		down_read(&current->mm->mmap_sem);
 		mutex_lock(&client->lock);
 		if (!ion_handle_validate(client, data.handle)) {
 			pr_err("%s: invalid handle passed to cache flush ioctl.\n",
 			       __func__);
 			mutex_unlock(&client->lock);
+			up_read(&current->mm->mmap_sem);
 			return -EINVAL;
 		}
 
 		ret = ion_flush_cached(data.handle, data.size, data.vaddr);
 		mutex_unlock(&client->lock);
+		up_read(&current->mm->mmap_sem);
 		if (ret)
 			return ret;
 		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
@@ -1040,16 +1504,19 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
+		down_read(&current->mm->mmap_sem);
 		mutex_lock(&client->lock);
 		if (!ion_handle_validate(client, data.handle)) {
 			pr_err("%s: invalid handle passed to cache inval ioctl.\n",
 			       __func__);
 			mutex_unlock(&client->lock);
+			up_read(&current->mm->mmap_sem);
 			return -EINVAL;
 		}
 
 		ret = ion_inval_cached(data.handle, data.size, data.vaddr);
 		mutex_unlock(&client->lock);
+		up_read(&current->mm->mmap_sem);
 		if (ret)
 			return ret;
 		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
@@ -1057,6 +1524,48 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
+	case ION_IOC_SYNC_CACHED:
+	{
+		struct ion_cache_sync_data data;
+		struct ion_cache_range *ranges;
+		int ret;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		if (!data.nr_ranges ||
+		    data.nr_ranges > ION_CACHE_SYNC_MAX_RANGES)
+			return -EINVAL;
+
+		ranges = kmalloc(sizeof(*ranges) * data.nr_ranges, GFP_KERNEL);
+		if (!ranges)
+			return -ENOMEM;
+		if (copy_from_user(ranges, (void __user *)data.ranges,
+				   sizeof(*ranges) * data.nr_ranges)) {
+			kfree(ranges);
+			return -EFAULT;
+		}
+
+		down_read(&current->mm->mmap_sem);
+		mutex_lock(&client->lock);
+		if (!ion_handle_validate(client, data.handle)) {
+			pr_err("%s: invalid handle passed to cache sync ioctl.\n",
+			       __func__);
+			mutex_unlock(&client->lock);
+			up_read(&current->mm->mmap_sem);
+			kfree(ranges);
+			return -EINVAL;
+		}
+
+		ret = ion_sync_cached(data.handle, data.vaddr, ranges,
+				      data.nr_ranges, data.op);
+		mutex_unlock(&client->lock);
+		up_read(&current->mm->mmap_sem);
+		kfree(ranges);
+		if (ret)
+			return ret;
+		break;
+	}
+
 	default:
 		return -ENOTTY;
 	}
@@ -1141,6 +1650,10 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		seq_printf(s, "%16.s %16.s %16u\n", "deferred free", "",
+			   ion_heap_freelist_size(heap));
 	return 0;
 }
 
@@ -1156,6 +1669,83 @@ static const struct file_operations debug_heap_fops = {
 	.release = single_release,
 };
 
+static int ion_debug_heap_stats_show(struct seq_file *s, void *unused)
+{
+	static const char *latency_names[ION_HEAP_LATENCY_BUCKETS] = {
+		"16us", "64us", "256us", "1ms", "4ms", "16ms", "64ms", "inf",
+	};
+	struct ion_heap *heap = s->private;
+	struct ion_heap_stats stats;
+	size_t free = 0, largest = 0;
+	int i;
+
+	spin_lock(&heap->stats.lock);
+	stats = heap->stats;
+	spin_unlock(&heap->stats.lock);
+
+	if (heap->ops->free_info)
+		heap->ops->free_info(heap, &free, &largest);
+
+	seq_printf(s, "allocated: %u\n", stats.allocated);
+	seq_printf(s, "peak: %u\n", stats.peak);
+	seq_printf(s, "allocs: %lu\n", stats.allocs);
+	seq_printf(s, "frees: %lu\n", stats.frees);
+	seq_printf(s, "failures: %lu\n", stats.failures);
+	if (heap->ops->free_info) {
+		seq_printf(s, "free: %u\n", free);
+		seq_printf(s, "largest_free: %u\n", largest);
+	}
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		seq_printf(s, "deferred: %u\n", ion_heap_freelist_size(heap));
+	for (i = 0; i < ION_HEAP_LATENCY_BUCKETS; i++)
+		seq_printf(s, "latency_%s: %lu\n", latency_names[i],
+			   stats.latency[i]);
+	return 0;
+}
+
+static int ion_debug_heap_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ion_debug_heap_stats_show, inode->i_private);
+}
+
+static const struct file_operations debug_heap_stats_fops = {
+	.open = ion_debug_heap_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int ion_debug_kmap_cache_show(struct seq_file *s, void *unused)
+{
+	struct ion_device *dev = s->private;
+	unsigned long hits, misses;
+
+	mutex_lock(&dev->kmap_lock);
+	hits = dev->kmap_hits;
+	misses = dev->kmap_misses;
+	seq_printf(s, "cached: %u\n", dev->kmap_lru_size);
+	seq_printf(s, "limit: %u\n", ION_KMAP_CACHE_MAX);
+	seq_printf(s, "hits: %lu\n", hits);
+	seq_printf(s, "misses: %lu\n", misses);
+	seq_printf(s, "evictions: %lu\n", dev->kmap_evictions);
+	mutex_unlock(&dev->kmap_lock);
+	seq_printf(s, "hit_rate: %lu%%\n",
+		   hits + misses ? hits * 100 / (hits + misses) : 0);
+	return 0;
+}
+
+static int ion_debug_kmap_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ion_debug_kmap_cache_show, inode->i_private);
+}
+
+static const struct file_operations debug_kmap_cache_fops = {
+	.open = ion_debug_kmap_cache_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 {
 	struct rb_node **p = &dev->heaps.rb_node;
@@ -1163,7 +1753,12 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	struct ion_heap *entry;
 
 	heap->dev = dev;
-	mutex_lock(&dev->lock);
+	mutex_init(&heap->lock);
+	spin_lock_init(&heap->stats.lock);
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_init_deferred_free(heap);
+
+	down_write(&dev->heap_lock);
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_heap, node);
@@ -1183,8 +1778,10 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	rb_insert_color(&heap->node, &dev->heaps);
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
+	debugfs_create_file(heap->name, 0444, dev->stats_root, heap,
+			    &debug_heap_stats_fops);
 end:
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 }
 
 struct ion_device *ion_device_create(long (*custom_ioctl)
@@ -1212,10 +1809,16 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 	idev->debug_root = debugfs_create_dir("ion", NULL);
 	if (IS_ERR_OR_NULL(idev->debug_root))
 		pr_err("ion: failed to create debug files.\n");
+	idev->stats_root = debugfs_create_dir("stats", idev->debug_root);
+	debugfs_create_file("kmap_cache", 0444, idev->debug_root, idev,
+			    &debug_kmap_cache_fops);
 
 	idev->custom_ioctl = custom_ioctl;
 	idev->buffers = RB_ROOT;
 	mutex_init(&idev->lock);
+	init_rwsem(&idev->heap_lock);
+	mutex_init(&idev->kmap_lock);
+	INIT_LIST_HEAD(&idev->kmap_lru);
 	idev->heaps = RB_ROOT;
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
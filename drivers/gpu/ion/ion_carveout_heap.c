@@ -15,11 +15,18 @@
  */
 #include <linux/spinlock.h>
 
+#include <linux/bitmap.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
+#include <linux/sched.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
@@ -28,37 +35,266 @@
 #include <asm/mach/map.h>
 #include <asm/cacheflush.h>
 
+/* single pages kept out of the pool for heaps that allocate page-wise */
+#define ION_CARVEOUT_RESERVOIR_PAGES 256
+
+/* zero at most this much memory per mapping */
+#define ION_CARVEOUT_ZERO_CHUNK	(1 << 20)
+
+/*
+ * Background zeroing: once an ION_FLAG_ZEROED allocation has been made
+ * from the heap, freed regions are handed to a low priority thread which
+ * zeroes them before returning them to the pool.  A bitmap tracks which
+ * free pages may still hold old data, so a zeroed allocation only has to
+ * clear those in the foreground.
+ */
 struct ion_carveout_heap {
 	struct ion_heap heap;
 	struct gen_pool *pool;
 	ion_phys_addr_t base;
+	spinlock_t reservoir_lock;
+	int reservoir_count;
+	ion_phys_addr_t reservoir[ION_CARVEOUT_RESERVOIR_PAGES];
+	spinlock_t zero_lock;		/* protects dirty and zero_list */
+	unsigned long *dirty;		/* pages that may hold old data */
+	struct list_head zero_list;	/* freed regions waiting to be zeroed */
+	wait_queue_head_t zero_wait;
+	struct task_struct *zero_task;
 };
 
-ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
-				      unsigned long size,
-				      unsigned long align)
+struct ion_carveout_region {
+	struct list_head list;
+	ion_phys_addr_t addr;
+	unsigned long size;
+};
+
+static void ion_carveout_mark_dirty(struct ion_carveout_heap *carveout_heap,
+				    ion_phys_addr_t addr, unsigned long size,
+				    bool dirty)
+{
+	int start = (addr - carveout_heap->base) >> PAGE_SHIFT;
+	int nr = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	spin_lock(&carveout_heap->zero_lock);
+	if (dirty)
+		bitmap_set(carveout_heap->dirty, start, nr);
+	else
+		bitmap_clear(carveout_heap->dirty, start, nr);
+	spin_unlock(&carveout_heap->zero_lock);
+}
+
+/*
+ * Drop whatever the caches still hold for the range from cacheable
+ * mappings of its previous owner, then zero it through an uncached
+ * mapping.  Invalidating first keeps a dirty line evicted during the
+ * memset from landing on the zeroes.  The previous owner's mappings are
+ * gone by now, so nothing refills the caches afterwards.
+ */
+static int ion_carveout_zero(ion_phys_addr_t addr, unsigned long size)
+{
+	while (size) {
+		unsigned long len = min_t(unsigned long, size,
+					  ION_CARVEOUT_ZERO_CHUNK);
+		void __iomem *vaddr = __arm_ioremap(addr, len,
+						    MT_MEMORY_NONCACHED);
+
+		if (!vaddr)
+			return -ENOMEM;
+		outer_inv_range(addr, addr + len);
+		dmac_unmap_area((void __force *)vaddr, len, DMA_FROM_DEVICE);
+		memset(vaddr, 0, len);
+		__arm_iounmap(vaddr);
+		addr += len;
+		size -= len;
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * zero the pages of an allocation that may hold old data, the caller owns
+ * the range so its bits can't change under us
+ */
+static int ion_carveout_zero_dirty(struct ion_carveout_heap *carveout_heap,
+				   ion_phys_addr_t addr, unsigned long size)
+{
+	int first = (addr - carveout_heap->base) >> PAGE_SHIFT;
+	int end = first + (PAGE_ALIGN(size) >> PAGE_SHIFT);
+	int start = find_next_bit(carveout_heap->dirty, end, first);
+	int ret = 0;
+
+	while (start < end && !ret) {
+		int stop = find_next_zero_bit(carveout_heap->dirty, end, start);
+
+		ret = ion_carveout_zero(carveout_heap->base +
+					((ion_phys_addr_t)start << PAGE_SHIFT),
+					(stop - start) << PAGE_SHIFT);
+		start = find_next_bit(carveout_heap->dirty, end, stop);
+	}
+	return ret;
+}
+
+/* give regions still waiting to be zeroed back to the pool as they are */
+static bool ion_carveout_zero_flush(struct ion_carveout_heap *carveout_heap)
+{
+	struct ion_carveout_region *region, *tmp;
+	LIST_HEAD(regions);
+	bool flushed;
+
+	spin_lock(&carveout_heap->zero_lock);
+	list_splice_init(&carveout_heap->zero_list, &regions);
+	spin_unlock(&carveout_heap->zero_lock);
+
+	flushed = !list_empty(&regions);
+	list_for_each_entry_safe(region, tmp, &regions, list) {
+		gen_pool_free(carveout_heap->pool, region->addr, region->size);
+		kfree(region);
+	}
+	return flushed;
+}
+
+static int ion_carveout_zero_thread(void *data)
+{
+	struct ion_carveout_heap *carveout_heap = data;
+	struct ion_carveout_region *region;
+
+	set_freezable();
+	set_user_nice(current, 19);
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(carveout_heap->zero_wait,
+				     !list_empty(&carveout_heap->zero_list) ||
+				     kthread_should_stop());
+
+		region = NULL;
+		spin_lock(&carveout_heap->zero_lock);
+		if (!list_empty(&carveout_heap->zero_list)) {
+			region = list_first_entry(&carveout_heap->zero_list,
+					struct ion_carveout_region, list);
+			list_del(&region->list);
+		}
+		spin_unlock(&carveout_heap->zero_lock);
+		if (!region)
+			continue;
+
+		if (!ion_carveout_zero(region->addr, region->size))
+			ion_carveout_mark_dirty(carveout_heap, region->addr,
+						region->size, false);
+		gen_pool_free(carveout_heap->pool, region->addr, region->size);
+		kfree(region);
+	}
+	return 0;
+}
+
+static ion_phys_addr_t ion_carveout_alloc_region(struct ion_heap *heap,
+						 unsigned long size,
+						 bool zeroed)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
 	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
 
+	/* memory may be waiting for the zeroing thread */
+	if (!offset && ion_carveout_zero_flush(carveout_heap))
+		offset = gen_pool_alloc(carveout_heap->pool, size);
 	if (!offset)
 		return ION_CARVEOUT_ALLOCATE_FAIL;
 
+	if (zeroed &&
+	    ion_carveout_zero_dirty(carveout_heap, offset, size)) {
+		gen_pool_free(carveout_heap->pool, offset, size);
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+	}
+	/* whoever owns it now may write to it */
+	ion_carveout_mark_dirty(carveout_heap, offset, size, true);
+
 	return offset;
 }
 
+ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
+				      unsigned long size,
+				      unsigned long align)
+{
+	return ion_carveout_alloc_region(heap, size, false);
+}
+
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_region *region;
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
+
+	if (carveout_heap->zero_task) {
+		region = kmalloc(sizeof(*region), GFP_KERNEL);
+		if (region) {
+			region->addr = addr;
+			region->size = size;
+			spin_lock(&carveout_heap->zero_lock);
+			list_add_tail(&region->list,
+				      &carveout_heap->zero_list);
+			spin_unlock(&carveout_heap->zero_lock);
+			wake_up(&carveout_heap->zero_wait);
+			return;
+		}
+	}
 	gen_pool_free(carveout_heap->pool, addr, size);
 }
 
+int ion_carveout_reservoir_get(struct ion_heap *heap, ion_phys_addr_t *addrs,
+			       int n)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+
+	spin_lock(&carveout_heap->reservoir_lock);
+	n = min(n, carveout_heap->reservoir_count);
+	carveout_heap->reservoir_count -= n;
+	memcpy(addrs, carveout_heap->reservoir + carveout_heap->reservoir_count,
+	       n * sizeof(*addrs));
+	spin_unlock(&carveout_heap->reservoir_lock);
+
+	return n;
+}
+
+int ion_carveout_reservoir_put(struct ion_heap *heap, ion_phys_addr_t *addrs,
+			       int n)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+
+	spin_lock(&carveout_heap->reservoir_lock);
+	n = min(n, ION_CARVEOUT_RESERVOIR_PAGES -
+		   carveout_heap->reservoir_count);
+	memcpy(carveout_heap->reservoir + carveout_heap->reservoir_count,
+	       addrs, n * sizeof(*addrs));
+	carveout_heap->reservoir_count += n;
+	spin_unlock(&carveout_heap->reservoir_lock);
+
+	return n;
+}
+
+int ion_carveout_reservoir_drain(struct ion_heap *heap)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	int i, n;
+
+	/* gen_pool_free() doesn't sleep */
+	spin_lock(&carveout_heap->reservoir_lock);
+	n = carveout_heap->reservoir_count;
+	for (i = 0; i < n; i++)
+		gen_pool_free(carveout_heap->pool, carveout_heap->reservoir[i],
+			      PAGE_SIZE);
+	carveout_heap->reservoir_count = 0;
+	spin_unlock(&carveout_heap->reservoir_lock);
+
+	return n;
+}
+
 static int ion_carveout_heap_phys(struct ion_heap *heap,
 				  struct ion_buffer *buffer,
 				  ion_phys_addr_t *addr, size_t *len)
@@ -73,7 +309,24 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 				      unsigned long size, unsigned long align,
 				      unsigned long flags)
 {
-	buffer->priv_phys = ion_carveout_allocate(heap, size, align);
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	bool zeroed = flags & ION_FLAG_ZEROED;
+
+	/* allocations are serialized by heap->lock */
+	if (zeroed && !carveout_heap->zero_task) {
+		struct task_struct *task;
+
+		task = kthread_run(ion_carveout_zero_thread, carveout_heap,
+				   "ion_zero_%s", heap->name);
+		if (!IS_ERR(task))
+			carveout_heap->zero_task = task;
+		else
+			pr_err("%s: creating zeroing thread failed\n",
+			       __func__);
+	}
+
+	buffer->priv_phys = ion_carveout_alloc_region(heap, size, zeroed);
 	return buffer->priv_phys == ION_CARVEOUT_ALLOCATE_FAIL ? -ENOMEM : 0;
 }
 
@@ -116,42 +369,186 @@ static void per_cpu_cache_flush_arm(void *arg)
 	flush_cache_all();
 }
 
-static int ion_carveout_heap_cache_operation(struct ion_buffer *buffer,
-		size_t len, unsigned long vaddr, enum cache_operation cacheop)
+/*
+ * Measured cost of cache maintenance.  Range maintenance costs about the
+ * same per cache line, while a full flush costs about the same whatever
+ * the size but interrupts every core and empties all caches, so it is only
+ * used when it is measured to be cheaper.  Costs are running averages in
+ * ns, 0 until first measured.
+ */
+static DEFINE_SPINLOCK(cache_cost_lock);
+static u32 cache_line_ns;
+static u32 cache_full_ns;
+
+static void ion_cache_cost_update(u32 *cost, u32 sample)
+{
+	spin_lock(&cache_cost_lock);
+	*cost = *cost ? (*cost * 7 + sample) / 8 : sample;
+	spin_unlock(&cache_cost_lock);
+}
+
+static bool ion_cache_use_full_flush(size_t total)
+{
+	u64 range_ns;
+	bool full;
+
+	spin_lock(&cache_cost_lock);
+	if (!cache_full_ns || !cache_line_ns) {
+		/* measure a full flush once it may be worth it */
+		full = !cache_full_ns && total > FULL_CACHE_FLUSH_THRESHOLD;
+	} else {
+		range_ns = (u64) cache_line_ns * (total / L1_CACHE_BYTES);
+		full = range_ns > cache_full_ns;
+	}
+	spin_unlock(&cache_cost_lock);
+	return full;
+}
+
+/* inner cache maintenance on the virtual range [start, end) */
+static void ion_inner_cache_range(unsigned long start, unsigned long end,
+				  enum cache_operation op)
+{
+	if (op == CACHE_FLUSH)
+		dmac_flush_range((void *)start, (void *)end);
+	else if (op == CACHE_INVALIDATE)
+		dmac_unmap_area((void *)start, end - start, DMA_FROM_DEVICE);
+	else
+		dmac_map_area((void *)start, end - start, DMA_TO_DEVICE);
+}
+
+int ion_cache_sync_ranges(struct ion_buffer *buffer, unsigned long vaddr,
+			  struct ion_cache_range *ranges, unsigned int nr,
+			  enum cache_operation op,
+			  void (*outer_range)(struct ion_buffer *buffer,
+					      size_t offset, size_t len,
+					      enum cache_operation op))
 {
+	size_t total = 0;
+	ktime_t start;
+	unsigned int i;
+
 	if (!buffer || !buffer->cached) {
 		pr_err("%s(): buffer not mapped as cacheable\n", __func__);
 		return -EINVAL;
 	}
 
-	if (len > FULL_CACHE_FLUSH_THRESHOLD) {
+	for (i = 0; i < nr; i++)
+		total += ranges[i].len;
+	if (!total)
+		return 0;
+
+	start = ktime_get();
+	if (ion_cache_use_full_flush(total)) {
+		/* a flush also covers clean and invalidate */
 		on_each_cpu(per_cpu_cache_flush_arm, NULL, 1);
 		outer_flush_all();
+		ion_cache_cost_update(&cache_full_ns, (u32)
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
 		return 0;
 	}
 
-	 __cpuc_coherent_user_range((vaddr) & PAGE_MASK, PAGE_ALIGN(vaddr+len));
+	for (i = 0; i < nr; i++) {
+		unsigned long va = vaddr + ranges[i].offset;
+		unsigned long va_start = va & ~(L1_CACHE_BYTES - 1);
+		unsigned long va_end = ALIGN(va + ranges[i].len, L1_CACHE_BYTES);
 
-	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(buffer->priv_phys, buffer->priv_phys+len);
-	else
-		outer_inv_range(buffer->priv_phys, buffer->priv_phys+len);
+		if (!ranges[i].len)
+			continue;
+		/*
+		 * Invalidate the outer cache first, or the inner cache could
+		 * refill from stale outer lines in between.
+		 */
+		if (op == CACHE_INVALIDATE) {
+			outer_range(buffer, ranges[i].offset, ranges[i].len, op);
+			ion_inner_cache_range(va_start, va_end, op);
+		} else {
+			ion_inner_cache_range(va_start, va_end, op);
+			outer_range(buffer, ranges[i].offset, ranges[i].len, op);
+		}
+	}
 
+	ion_cache_cost_update(&cache_line_ns, (u32)
+			div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+				DIV_ROUND_UP(total, L1_CACHE_BYTES)));
 	return 0;
 }
 
+void ion_outer_cache_range(ion_phys_addr_t start, ion_phys_addr_t end,
+				  enum cache_operation op)
+{
+	if (op == CACHE_FLUSH)
+		outer_flush_range(start, end);
+	else if (op == CACHE_INVALIDATE)
+		outer_inv_range(start, end);
+	else
+		outer_clean_range(start, end);
+}
+
+static void ion_carveout_heap_outer_range(struct ion_buffer *buffer,
+					  size_t offset, size_t len,
+					  enum cache_operation op)
+{
+	ion_outer_cache_range(buffer->priv_phys + offset,
+			      buffer->priv_phys + offset + len, op);
+}
+
+static int ion_carveout_heap_sync_user(struct ion_buffer *buffer,
+				       unsigned long vaddr,
+				       struct ion_cache_range *ranges,
+				       unsigned int nr,
+				       enum cache_operation op)
+{
+	return ion_cache_sync_ranges(buffer, vaddr, ranges, nr, op,
+				     ion_carveout_heap_outer_range);
+}
+
 static int ion_carveout_heap_flush_user(struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr)
 {
-	return ion_carveout_heap_cache_operation(buffer, len,
-			vaddr, CACHE_FLUSH);
+	struct ion_cache_range range = { .offset = 0, .len = len };
+
+	return ion_carveout_heap_sync_user(buffer, vaddr, &range, 1,
+					   CACHE_FLUSH);
 }
 
 static int ion_carveout_heap_inval_user(struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr)
 {
-	return ion_carveout_heap_cache_operation(buffer, len,
-			vaddr, CACHE_INVALIDATE);
+	struct ion_cache_range range = { .offset = 0, .len = len };
+
+	return ion_carveout_heap_sync_user(buffer, vaddr, &range, 1,
+					   CACHE_INVALIDATE);
+}
+
+static void ion_carveout_chunk_largest(struct gen_pool *pool,
+				       struct gen_pool_chunk *chunk,
+				       void *data)
+{
+	size_t *largest = data;
+	int order = pool->min_alloc_order;
+	unsigned long nbits = (chunk->end_addr - chunk->start_addr) >> order;
+	unsigned long start, end;
+
+	start = find_first_zero_bit(chunk->bits, nbits);
+	while (start < nbits) {
+		end = find_next_bit(chunk->bits, nbits, start);
+		if ((end - start) << order > *largest)
+			*largest = (end - start) << order;
+		start = find_next_zero_bit(chunk->bits, nbits, end);
+	}
+}
+
+/* walks the pool bitmap, only meant for statistics */
+void ion_carveout_free_info(struct ion_heap *heap, size_t *free,
+			    size_t *largest)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+
+	*free = gen_pool_avail(carveout_heap->pool);
+	*largest = 0;
+	gen_pool_for_each_chunk(carveout_heap->pool,
+				ion_carveout_chunk_largest, largest);
 }
 
 static struct ion_heap_ops carveout_heap_ops = {
@@ -163,6 +560,10 @@ static struct ion_heap_ops carveout_heap_ops = {
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
 	.flush_user = ion_carveout_heap_flush_user,
 	.inval_user = ion_carveout_heap_inval_user,
+	.sync_user = ion_carveout_heap_sync_user,
+	.free_info = ion_carveout_free_info,
+	.map_dma_buf = ion_heap_map_dma_buf_contig,
+	.unmap_dma_buf = ion_heap_unmap_dma_buf,
 };
 
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
@@ -178,11 +579,26 @@ struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 		kfree(carveout_heap);
 		return ERR_PTR(-ENOMEM);
 	}
+	carveout_heap->dirty = kmalloc(BITS_TO_LONGS(heap_data->size >>
+						    PAGE_SHIFT) *
+				       sizeof(unsigned long), GFP_KERNEL);
+	if (!carveout_heap->dirty) {
+		gen_pool_destroy(carveout_heap->pool);
+		kfree(carveout_heap);
+		return ERR_PTR(-ENOMEM);
+	}
+	/* nothing is known about what the carveout holds at boot */
+	bitmap_fill(carveout_heap->dirty, heap_data->size >> PAGE_SHIFT);
+	spin_lock_init(&carveout_heap->zero_lock);
+	INIT_LIST_HEAD(&carveout_heap->zero_list);
+	init_waitqueue_head(&carveout_heap->zero_wait);
 	carveout_heap->base = heap_data->base;
+	spin_lock_init(&carveout_heap->reservoir_lock);
 	gen_pool_add(carveout_heap->pool, carveout_heap->base, heap_data->size,
 		     -1);
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
+	carveout_heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
 
 	return &carveout_heap->heap;
 }
@@ -192,7 +608,13 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
 
+	ion_heap_deinit_deferred_free(heap);
+	if (carveout_heap->zero_task)
+		kthread_stop(carveout_heap->zero_task);
+	ion_carveout_zero_flush(carveout_heap);
+	ion_carveout_reservoir_drain(heap);
 	gen_pool_destroy(carveout_heap->pool);
+	kfree(carveout_heap->dirty);
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
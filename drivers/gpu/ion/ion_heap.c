@@ -15,9 +15,92 @@
  */
 
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include "ion_priv.h"
 
+static void ion_heap_stats_latency(struct ion_heap *heap, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	if (us >= 16)
+		bucket = min_t(int, (ilog2(us) - 4) / 2 + 1,
+			       ION_HEAP_LATENCY_BUCKETS - 1);
+	heap->stats.latency[bucket]++;
+}
+
+void ion_heap_stats_alloc(struct ion_heap *heap, size_t size, ktime_t start)
+{
+	spin_lock(&heap->stats.lock);
+	heap->stats.allocated += size;
+	if (heap->stats.allocated > heap->stats.peak)
+		heap->stats.peak = heap->stats.allocated;
+	heap->stats.allocs++;
+	ion_heap_stats_latency(heap, start);
+	spin_unlock(&heap->stats.lock);
+}
+
+void ion_heap_stats_fail(struct ion_heap *heap, ktime_t start)
+{
+	spin_lock(&heap->stats.lock);
+	heap->stats.failures++;
+	ion_heap_stats_latency(heap, start);
+	spin_unlock(&heap->stats.lock);
+}
+
+void ion_heap_stats_free(struct ion_heap *heap, size_t size)
+{
+	spin_lock(&heap->stats.lock);
+	heap->stats.allocated -= size;
+	heap->stats.frees++;
+	spin_unlock(&heap->stats.lock);
+}
+
+struct sg_table *ion_heap_map_dma_buf_contig(struct ion_heap *heap,
+					     struct ion_buffer *buffer,
+					     struct device *dev)
+{
+	struct sg_table *table;
+	ion_phys_addr_t paddr;
+	size_t len;
+	int ret;
+
+	ret = heap->ops->phys(heap, buffer, &paddr, &len);
+	if (ret)
+		return ERR_PTR(ret);
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+	ret = sg_alloc_table(table, 1, GFP_KERNEL);
+	if (ret) {
+		kfree(table);
+		return ERR_PTR(ret);
+	}
+
+	/*
+	 * the devices sharing these see physical memory, no iommu mapping.
+	 * Carveouts are removed from the kernel's memory map and have no
+	 * struct page, so importers only get the dma address.
+	 */
+	sg_dma_address(table->sgl) = paddr;
+	sg_dma_len(table->sgl) = len;
+	return table;
+}
+
+void ion_heap_unmap_dma_buf(struct ion_heap *heap, struct ion_buffer *buffer,
+			    struct sg_table *table)
+{
+	sg_free_table(table);
+	kfree(table);
+}
+
 struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
 {
 	struct ion_heap *heap = NULL;
@@ -70,3 +153,106 @@ void ion_heap_destroy(struct ion_heap *heap)
 		       heap->type);
 	}
 }
+
+bool ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
+{
+	bool added = false;
+
+	spin_lock(&heap->free_lock);
+	if (heap->free_list_size + buffer->size <= ION_HEAP_DEFER_FREE_MAX) {
+		list_add_tail(&buffer->list, &heap->free_list);
+		heap->free_list_size += buffer->size;
+		added = true;
+	}
+	spin_unlock(&heap->free_lock);
+
+	if (added)
+		wake_up(&heap->waitqueue);
+	return added;
+}
+
+size_t ion_heap_freelist_size(struct ion_heap *heap)
+{
+	size_t size;
+
+	spin_lock(&heap->free_lock);
+	size = heap->free_list_size;
+	spin_unlock(&heap->free_lock);
+
+	return size;
+}
+
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size)
+{
+	struct ion_buffer *buffer;
+	size_t total = 0;
+
+	if (!(heap->flags & ION_HEAP_FLAG_DEFER_FREE))
+		return 0;
+
+	for (;;) {
+		spin_lock(&heap->free_lock);
+		if (list_empty(&heap->free_list) || (size && total >= size)) {
+			spin_unlock(&heap->free_lock);
+			break;
+		}
+		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
+					  list);
+		list_del(&buffer->list);
+		heap->free_list_size -= buffer->size;
+		spin_unlock(&heap->free_lock);
+
+		total += buffer->size;
+		ion_buffer_free(buffer);
+	}
+
+	return total;
+}
+
+static int ion_heap_deferred_free(void *data)
+{
+	struct ion_heap *heap = data;
+
+	set_freezable();
+	set_user_nice(current, 10);
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(heap->waitqueue,
+				     ion_heap_freelist_size(heap) > 0 ||
+				     kthread_should_stop());
+		ion_heap_freelist_drain(heap, 0);
+	}
+
+	return 0;
+}
+
+int ion_heap_init_deferred_free(struct ion_heap *heap)
+{
+	INIT_LIST_HEAD(&heap->free_list);
+	heap->free_list_size = 0;
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+
+	heap->task = kthread_run(ion_heap_deferred_free, heap,
+				 "ion_free_%s", heap->name);
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		heap->task = NULL;
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void ion_heap_deinit_deferred_free(struct ion_heap *heap)
+{
+	if (!heap->task)
+		return;
+
+	kthread_stop(heap->task);
+	heap->task = NULL;
+	ion_heap_freelist_drain(heap, 0);
+	heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+}
@@ -0,0 +1,102 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include "ion_priv.h"
+
+/*
+ * A page pool caches zeroed pages of a single order.  Pages are linked
+ * through page->lru while they sit in the pool.  The pool does not allocate
+ * by itself; callers fall back to the page allocator when it is empty.
+ */
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->items);
+	spin_lock_init(&pool->lock);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	ion_page_pool_shrink(pool, pool->count);
+	kfree(pool);
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		page = list_first_entry(&pool->items, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+	}
+	spin_unlock(&pool->lock);
+	return page;
+}
+
+/* page must be zeroed */
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->items);
+	pool->count++;
+	spin_unlock(&pool->lock);
+}
+
+/* add up to count freshly allocated chunks, returns number added */
+int ion_page_pool_fill(struct ion_page_pool *pool, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct page *page = alloc_pages(pool->gfp_mask | __GFP_ZERO,
+						pool->order);
+		if (!page)
+			break;
+		ion_page_pool_free(pool, page);
+	}
+	return i;
+}
+
+/* free up to nr_to_free chunks, returns number of chunks left */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_free)
+{
+	int left;
+
+	while (nr_to_free-- > 0) {
+		struct page *page = ion_page_pool_alloc(pool);
+		if (!page)
+			break;
+		__free_pages(page, pool->order);
+	}
+
+	spin_lock(&pool->lock);
+	left = pool->count;
+	spin_unlock(&pool->lock);
+	return left;
+}
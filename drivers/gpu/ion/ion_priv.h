@@ -18,9 +18,13 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
 
@@ -40,20 +44,37 @@ struct ion_kernel_mapping {
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
  * @buffers:	an rb tree of all the existing buffers
- * @lock:		lock protecting the buffers & heaps trees
+ * @lock:		lock protecting the buffers & clients trees
+ * @heap_lock:		rwsem protecting the heaps tree, taken for reading
+ *			while walking the heaps to allocate
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
+ * @stats_root:		debugfs directory of the per heap statistics
+ * @kmap_lock:		protects the kernel mapping cache
+ * @kmap_lru:		buffers with an unused kernel mapping, oldest first
+ * @kmap_lru_size:	size of the buffers on kmap_lru in bytes
+ * @kmap_hits:		maps that reused a cached mapping
+ * @kmap_misses:	maps that had to create a new mapping
+ * @kmap_evictions:	cached mappings released to stay within the limit
  */
 struct ion_device {
 	struct miscdevice dev;
 	struct rb_root buffers;
 	struct mutex lock;
+	struct rw_semaphore heap_lock;
 	struct rb_root heaps;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
 	struct rb_root user_clients;
 	struct rb_root kernel_clients;
 	struct dentry *debug_root;
+	struct dentry *stats_root;
+	struct mutex kmap_lock;
+	struct list_head kmap_lru;
+	size_t kmap_lru_size;
+	unsigned long kmap_hits;
+	unsigned long kmap_misses;
+	unsigned long kmap_evictions;
 };
 
 /**
@@ -126,6 +147,9 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @list:		node in the heap's deferred free list
+ * @kmap_lru:		node in the device's kernel mapping cache, the
+ *			mapping in vaddr is kept while kmap_cnt is zero
 */
 struct ion_buffer {
 	struct kref ref;
@@ -144,6 +168,15 @@ struct ion_buffer {
 	int dmap_cnt;
 	struct scatterlist *sglist;
 	bool cached;
+	struct list_head list;
+	struct list_head kmap_lru;
+};
+
+/* values match the ION_CACHE_SYNC_* operations of ION_IOC_SYNC_CACHED */
+enum cache_operation {
+	CACHE_CLEAN		= 0x0,
+	CACHE_INVALIDATE	= 0x1,
+	CACHE_FLUSH		= 0x2,
 };
 
 /**
@@ -159,6 +192,13 @@ struct ion_buffer {
  * @map_user		map memory to userspace
  * @flush_user		flush memory if mapped as cacheable
  * @inval_user		invalidate memory if mapped as cacheable
+ * @sync_user		clean, invalidate or flush ranges of memory mapped as
+ *			cacheable, at a kernel address or at a user address
+ *			checked by the caller
+ * @free_info		report free bytes and the largest free chunk, optional
+ * @map_dma_buf		build an sg_table for a dma-buf attachment of device
+ *			dev, needed to export buffers of this heap as dma-bufs
+ * @unmap_dma_buf	free a table returned by map_dma_buf
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -178,6 +218,42 @@ struct ion_heap_ops {
 			unsigned long vaddr);
 	int (*inval_user) (struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr);
+	int (*sync_user) (struct ion_buffer *buffer, unsigned long vaddr,
+			  struct ion_cache_range *ranges, unsigned int nr,
+			  enum cache_operation op);
+	void (*free_info) (struct ion_heap *heap, size_t *free,
+			   size_t *largest);
+	struct sg_table *(*map_dma_buf) (struct ion_heap *heap,
+					 struct ion_buffer *buffer,
+					 struct device *dev);
+	void (*unmap_dma_buf) (struct ion_heap *heap, struct ion_buffer *buffer,
+			       struct sg_table *table);
+};
+
+/* allocation latency buckets: <16us, <64us, ... <64ms, >=64ms */
+#define ION_HEAP_LATENCY_BUCKETS	8
+
+/**
+ * struct ion_heap_stats - usage counters of a heap
+ * @lock:		protects the counters
+ * @allocated:		bytes currently allocated
+ * @peak:		highest value of @allocated seen
+ * @allocs:		number of successful allocations
+ * @frees:		number of buffers freed
+ * @failures:		number of failed allocation attempts
+ * @latency:		histogram of allocation times, in powers of 4us
+ *
+ * Updated on every allocation and free, so reading them never has to walk
+ * clients or buffers.
+ */
+struct ion_heap_stats {
+	spinlock_t lock;
+	size_t allocated;
+	size_t peak;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+	unsigned long latency[ION_HEAP_LATENCY_BUCKETS];
 };
 
 /**
@@ -190,6 +266,15 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @lock:		serializes allocations from this heap, so allocations
+ *			from different heaps can proceed in parallel
+ * @flags:		heap flags, e.g. ION_HEAP_FLAG_DEFER_FREE
+ * @free_list:		buffers waiting to be freed by the deferred free thread
+ * @free_list_size:	size of the buffers on the free list in bytes
+ * @free_lock:		protects free_list and free_list_size
+ * @waitqueue:		wakes the deferred free thread
+ * @task:		the deferred free thread
+ * @stats:		usage counters, see struct ion_heap_stats
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -203,8 +288,25 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	struct mutex lock;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct ion_heap_stats stats;
 };
 
+/*
+ * Free buffers of this heap from a per-heap thread instead of from the
+ * context that drops the last reference.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
+/* buffers are freed synchronously once this much is waiting to be freed */
+#define ION_HEAP_DEFER_FREE_MAX		(64 << 20)
+
 /**
  * ion_device_create - allocates and returns an ion device
  * @custom_ioctl:	arch specific ioctl function if applicable
@@ -238,6 +340,47 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * deferred free support for heaps with ION_HEAP_FLAG_DEFER_FREE
+ *
+ * ion_heap_freelist_add() returns false if the backlog is full, in which
+ * case the caller frees the buffer itself.  ion_heap_freelist_drain()
+ * frees up to size bytes (everything if 0) from the calling context and
+ * returns the number of bytes freed.  Carveout and tiler memory is not
+ * part of the page allocator, so the free list is not exposed to reclaim;
+ * allocation failures drain it instead.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+void ion_heap_deinit_deferred_free(struct ion_heap *heap);
+bool ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+void ion_buffer_free(struct ion_buffer *buffer);
+
+/**
+ * dma-buf tables for physically contiguous heaps, built from ops->phys.
+ * The memory need not have a struct page, so only the dma address and
+ * length of the single entry are set.
+ */
+struct sg_table *ion_heap_map_dma_buf_contig(struct ion_heap *heap,
+					     struct ion_buffer *buffer,
+					     struct device *dev);
+void ion_heap_unmap_dma_buf(struct ion_heap *heap, struct ion_buffer *buffer,
+			    struct sg_table *table);
+
+/**
+ * heap statistics
+ *
+ * ion core accounts every buffer allocated through the heap ops.  Heaps
+ * that size their buffers outside of ops->allocate (len 0) account them
+ * with ion_heap_stats_alloc() once buffer->size is known; frees are always
+ * accounted by the core using buffer->size.  start is the ktime_get() at
+ * which the allocation began.
+ */
+void ion_heap_stats_alloc(struct ion_heap *heap, size_t size, ktime_t start);
+void ion_heap_stats_fail(struct ion_heap *heap, ktime_t start);
+void ion_heap_stats_free(struct ion_heap *heap, size_t size);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -254,23 +397,87 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap, unsigned long size,
 				      unsigned long align);
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
+/**
+ * reservoir of single carveout pages for heaps that fall back to page-wise
+ * allocations.  get takes and put gives back up to n pages in one go, both
+ * return the number of pages actually taken or given.  drain returns every
+ * page to the pool so that they can coalesce again, and returns how many
+ * there were.
+ */
+int ion_carveout_reservoir_get(struct ion_heap *heap, ion_phys_addr_t *addrs,
+			       int n);
+int ion_carveout_reservoir_put(struct ion_heap *heap, ion_phys_addr_t *addrs,
+			       int n);
+int ion_carveout_reservoir_drain(struct ion_heap *heap);
+/* free bytes and largest free chunk of the carveout pool */
+void ion_carveout_free_info(struct ion_heap *heap, size_t *free,
+			    size_t *largest);
 /**
  * The carveout heap returns physical addresses, since 0 may be a valid
  * physical address, this is used to indicate allocation failed
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of chunks in the pool
+ * @order:		order of the chunks in the pool
+ * @gfp_mask:		gfp_mask used to refill the pool
+ * @items:		list of zeroed chunks, linked through page->lru
+ * @lock:		protects count and items
+ *
+ * Allows you to keep a pool of pre-zeroed chunks of a given order to
+ * allocate from.  The pool only gives out what it holds; callers fall
+ * back to the page allocator when it is empty and decide themselves when
+ * to refill or shrink it.
+ */
+struct ion_page_pool {
+	int count;
+	unsigned int order;
+	gfp_t gfp_mask;
+	struct list_head items;
+	spinlock_t lock;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_fill(struct ion_page_pool *pool, int count);
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_free);
+
+/**
+ * ion_cache_sync_ranges - cache maintenance on ranges of a buffer mapped
+ * cacheable at vaddr
+ * @outer_range:	does the outer cache maintenance for a range of the
+ *			buffer, as only the heap knows its physical layout
+ *
+ * Cleans, invalidates or flushes (cleans and invalidates) the inner and
+ * outer caches, outer first when invalidating.  Range maintenance is used
+ * unless a full flush of all caches was measured to be cheaper for the
+ * total length of the ranges.
+ *
+ * vaddr is not checked here: it is either the kernel mapping of the buffer
+ * or a user mapping that the ioctl path checked with the current process'
+ * mmap_sem held, which it keeps holding across the call.
+ */
+int ion_cache_sync_ranges(struct ion_buffer *buffer, unsigned long vaddr,
+			  struct ion_cache_range *ranges, unsigned int nr,
+			  enum cache_operation op,
+			  void (*outer_range)(struct ion_buffer *buffer,
+					      size_t offset, size_t len,
+					      enum cache_operation op));
+
+/* outer cache maintenance on the physical range [start, end) */
+void ion_outer_cache_range(ion_phys_addr_t start, ion_phys_addr_t end,
+			   enum cache_operation op);
+
 /**
  * Flushing entire cache is more efficient than flushing virtual address
  * range of a buffer whose size is 200Kbytes or higher, since line by
- * line operations of huge buffers consume lot of cpu cycles
+ * line operations of huge buffers consume lot of cpu cycles.  This is only
+ * used until the cost of both has been measured.
  */
 #define FULL_CACHE_FLUSH_THRESHOLD 200000
 
-enum cache_operation {
-	CACHE_CLEAN		= 0x0,
-	CACHE_INVALIDATE	= 0x1,
-	CACHE_FLUSH		= 0x2,
-};
-
 #endif /* _ION_PRIV_H */
@@ -15,84 +15,389 @@
  */
 
 #include <linux/err.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "ion_priv.h"
 
+/*
+ * The system heap builds buffers out of the largest chunks available from
+ * per-order page pools, falling back to the page allocator when a pool is
+ * empty.  Freed chunks are zeroed in the background and returned to their
+ * pool, pools that ran dry are refilled in the background up to their low
+ * mark, and a shrinker gives pooled pages back under memory pressure.
+ */
+static const struct {
+	unsigned int order;
+	int low;		/* chunks kept ready by the refill work */
+	int high;		/* chunks kept at most, the rest is freed */
+} pool_orders[] = {
+	{ 8, 2, 16 },
+	{ 4, 8, 64 },
+	{ 0, 64, 1024 },
+};
+#define NUM_ORDERS ARRAY_SIZE(pool_orders)
+
+/* don't try hard for high-order chunks, smaller ones will do */
+static const gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
+					   __GFP_NORETRY) & ~__GFP_WAIT;
+static const gfp_t low_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct list_head dirty;		/* freed chunks waiting to be zeroed */
+	spinlock_t dirty_lock;
+	struct work_struct zero_work;
+	struct work_struct refill_work;
+	struct shrinker shrinker;
+};
+
+struct ion_system_buffer_info {
+	struct scatterlist *sglist;
+	int nents;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == pool_orders[i].order)
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct scatterlist *ion_system_sglist_alloc(int nents)
+{
+	size_t size = nents * sizeof(struct scatterlist);
+
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void ion_system_sglist_free(struct scatterlist *sglist)
+{
+	if (is_vmalloc_addr(sglist))
+		vfree(sglist);
+	else
+		kfree(sglist);
+}
+
+/*
+ * Get a zeroed chunk of at most size bytes, trying orders from *index on
+ * so that a buffer never uses larger chunks than it started with.
+ */
+static struct page *ion_system_heap_get_chunk(struct ion_system_heap *sh,
+					      unsigned long size, int *index,
+					      bool *refill)
+{
+	struct page *page;
+	int i;
+
+	for (i = *index; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool = sh->pools[i];
+
+		if (size < (PAGE_SIZE << pool->order))
+			continue;
+
+		page = ion_page_pool_alloc(pool);
+		if (!page) {
+			*refill = true;
+			page = alloc_pages(pool->gfp_mask | __GFP_ZERO,
+					   pool->order);
+		}
+		if (page) {
+			*index = i;
+			return page;
+		}
+	}
+	return NULL;
+}
+
+/* queue a freed chunk for zeroing, or free it if its pool is full */
+static void ion_system_heap_put_chunk(struct ion_system_heap *sh,
+				      struct page *page, unsigned int order)
+{
+	int i = order_to_index(order);
+
+	if (sh->pools[i]->count >= pool_orders[i].high) {
+		__free_pages(page, order);
+		return;
+	}
+
+	set_page_private(page, order);
+	spin_lock(&sh->dirty_lock);
+	list_add_tail(&page->lru, &sh->dirty);
+	spin_unlock(&sh->dirty_lock);
+}
+
+static void ion_system_heap_zero_work(struct work_struct *work)
+{
+	struct ion_system_heap *sh = container_of(work, struct ion_system_heap,
+						  zero_work);
+	struct page *page;
+	unsigned int order;
+	int i;
+
+	for (;;) {
+		spin_lock(&sh->dirty_lock);
+		if (list_empty(&sh->dirty)) {
+			spin_unlock(&sh->dirty_lock);
+			break;
+		}
+		page = list_first_entry(&sh->dirty, struct page, lru);
+		list_del(&page->lru);
+		spin_unlock(&sh->dirty_lock);
+
+		order = page_private(page);
+		set_page_private(page, 0);
+		for (i = 0; i < (1 << order); i++)
+			clear_highpage(page + i);
+		ion_page_pool_free(sh->pools[order_to_index(order)], page);
+		cond_resched();
+	}
+}
+
+static void ion_system_heap_refill_work(struct work_struct *work)
+{
+	struct ion_system_heap *sh = container_of(work, struct ion_system_heap,
+						  refill_work);
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool = sh->pools[i];
+
+		if (pool->count < pool_orders[i].low)
+			ion_page_pool_fill(pool,
+					   pool_orders[i].low - pool->count);
+	}
+}
+
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sh = container_of(shrinker,
+						  struct ion_system_heap,
+						  shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	int left = 0;
+	int i;
+
+	/* give back the cheapest chunks to recreate first */
+	for (i = NUM_ORDERS - 1; i >= 0; i--) {
+		struct ion_page_pool *pool = sh->pools[i];
+		int count = ion_page_pool_shrink(pool, 0);
+
+		if (nr_to_scan > 0 && count) {
+			int chunks = min(count, DIV_ROUND_UP(nr_to_scan,
+							     1 << pool->order));
+			count = ion_page_pool_shrink(pool, chunks);
+			nr_to_scan -= chunks << pool->order;
+		}
+		left += count << pool->order;
+	}
+	return left;
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
-	buffer->priv_virt = vmalloc_user(size);
-	if (!buffer->priv_virt)
-		return -ENOMEM;
+	struct ion_system_heap *sh = container_of(heap, struct ion_system_heap,
+						  heap);
+	struct ion_system_buffer_info *info;
+	struct scatterlist *sg;
+	struct page *page, *tmp;
+	LIST_HEAD(chunks);
+	long remaining = PAGE_ALIGN(size);
+	bool refill = false;
+	int nents = 0;
+	int i = 0;
+
+	while (remaining > 0) {
+		page = ion_system_heap_get_chunk(sh, remaining, &i, &refill);
+		if (!page)
+			goto err;
+		set_page_private(page, pool_orders[i].order);
+		list_add_tail(&page->lru, &chunks);
+		remaining -= PAGE_SIZE << pool_orders[i].order;
+		nents++;
+	}
+
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		goto err;
+	info->sglist = ion_system_sglist_alloc(nents);
+	if (!info->sglist) {
+		kfree(info);
+		goto err;
+	}
+	sg_init_table(info->sglist, nents);
+	info->nents = nents;
+
+	sg = info->sglist;
+	list_for_each_entry_safe(page, tmp, &chunks, lru) {
+		list_del(&page->lru);
+		sg_set_page(sg, page, PAGE_SIZE << page_private(page), 0);
+		set_page_private(page, 0);
+		sg = sg_next(sg);
+	}
+	buffer->priv_virt = info;
+
+	if (refill)
+		schedule_work(&sh->refill_work);
 	return 0;
+
+err:
+	list_for_each_entry_safe(page, tmp, &chunks, lru) {
+		unsigned int order = page_private(page);
+
+		list_del(&page->lru);
+		set_page_private(page, 0);
+		__free_pages(page, order);
+	}
+	return -ENOMEM;
 }
 
 static void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	vfree(buffer->priv_virt);
+	struct ion_system_heap *sh = container_of(buffer->heap,
+						  struct ion_system_heap,
+						  heap);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(info->sglist, sg, info->nents, i)
+		ion_system_heap_put_chunk(sh, sg_page(sg),
+					  get_order(sg->length));
+	queue_work(system_unbound_wq, &sh->zero_work);
+
+	ion_system_sglist_free(info->sglist);
+	kfree(info);
 }
 
 static struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page *page;
-	int i;
-	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	void *vaddr = buffer->priv_virt;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
 
-	sglist = vmalloc(npages * sizeof(struct scatterlist));
-	if (!sglist)
-		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, npages * sizeof(struct scatterlist));
-	sg_init_table(sglist, npages);
-	for (i = 0; i < npages; i++) {
-		page = vmalloc_to_page(vaddr);
-		if (!page)
-			goto end;
-		sg_set_page(&sglist[i], page, PAGE_SIZE, 0);
-		vaddr += PAGE_SIZE;
-	}
-	/* XXX do cache maintenance for dma? */
-	return sglist;
-end:
-	vfree(sglist);
-	return NULL;
+	/* the chunk list is built at allocation time */
+	return info->sglist;
 }
 
 static void ion_system_heap_unmap_dma(struct ion_heap *heap,
 			       struct ion_buffer *buffer)
 {
-	/* XXX undo cache maintenance for dma? */
-	if (buffer->sglist)
-		vfree(buffer->sglist);
+}
+
+/* each attachment gets its own copy of the chunk list */
+static struct sg_table *ion_system_heap_map_dma_buf(struct ion_heap *heap,
+						    struct ion_buffer *buffer,
+						    struct device *dev)
+{
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	struct scatterlist *sg, *dst;
+	struct sg_table *table;
+	int i, ret;
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+	ret = sg_alloc_table(table, info->nents, GFP_KERNEL);
+	if (ret) {
+		kfree(table);
+		return ERR_PTR(ret);
+	}
+
+	dst = table->sgl;
+	for_each_sg(info->sglist, sg, info->nents, i) {
+		sg_set_page(dst, sg_page(sg), sg->length, 0);
+		sg_dma_address(dst) = sg_phys(sg);
+		sg_dma_len(dst) = sg->length;
+		dst = sg_next(dst);
+	}
+	return table;
 }
 
 static void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
-	return buffer->priv_virt;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	struct page **pages, **tmp;
+	struct scatterlist *sg;
+	void *vaddr;
+	int i, j;
+
+	pages = vmalloc(sizeof(struct page *) * npages);
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+
+	tmp = pages;
+	for_each_sg(info->sglist, sg, info->nents, i) {
+		struct page *page = sg_page(sg);
+
+		for (j = 0; j < sg->length / PAGE_SIZE; j++)
+			*(tmp++) = page++;
+	}
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	vfree(pages);
+	return vaddr ? vaddr : ERR_PTR(-ENOMEM);
 }
 
 static void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 				  struct ion_buffer *buffer)
 {
+	vunmap(buffer->vaddr);
 }
 
 static int ion_system_heap_map_user(struct ion_heap *heap,
 				struct ion_buffer *buffer,
 				struct vm_area_struct *vma)
 {
-	return remap_vmalloc_range(vma, buffer->priv_virt, vma->vm_pgoff);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
+	struct scatterlist *sg;
+	int i, ret;
+
+	for_each_sg(info->sglist, sg, info->nents, i) {
+		struct page *page = sg_page(sg);
+		unsigned long len = sg->length;
+
+		if (offset >= sg->length) {
+			offset -= sg->length;
+			continue;
+		} else if (offset) {
+			page += offset / PAGE_SIZE;
+			len -= offset;
+			offset = 0;
+		}
+
+		len = min(len, vma->vm_end - addr);
+		ret = remap_pfn_range(vma, addr, page_to_pfn(page), len,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+		addr += len;
+		if (addr >= vma->vm_end)
+			return 0;
+	}
+	return 0;
 }
 
-static struct ion_heap_ops vmalloc_ops = {
+static struct ion_heap_ops system_heap_ops = {
 	.allocate = ion_system_heap_allocate,
 	.free = ion_system_heap_free,
 	.map_dma = ion_system_heap_map_dma,
@@ -100,23 +405,71 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_kernel = ion_system_heap_map_kernel,
 	.unmap_kernel = ion_system_heap_unmap_kernel,
 	.map_user = ion_system_heap_map_user,
+	.map_dma_buf = ion_system_heap_map_dma_buf,
+	.unmap_dma_buf = ion_heap_unmap_dma_buf,
 };
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *sh;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
-	if (!heap)
+	sh = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
+	if (!sh)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		unsigned int order = pool_orders[i].order;
+
+		sh->pools[i] = ion_page_pool_create(order ?
+						    high_order_gfp_flags :
+						    low_order_gfp_flags,
+						    order);
+		if (!sh->pools[i])
+			goto err;
+	}
+
+	INIT_LIST_HEAD(&sh->dirty);
+	spin_lock_init(&sh->dirty_lock);
+	INIT_WORK(&sh->zero_work, ion_system_heap_zero_work);
+	INIT_WORK(&sh->refill_work, ion_system_heap_refill_work);
+	sh->shrinker.shrink = ion_system_heap_shrink;
+	sh->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sh->shrinker);
+
+	sh->heap.ops = &system_heap_ops;
+	sh->heap.type = ION_HEAP_TYPE_SYSTEM;
+	return &sh->heap;
+
+err:
+	while (i--)
+		ion_page_pool_destroy(sh->pools[i]);
+	kfree(sh);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sh = container_of(heap, struct ion_system_heap,
+						  heap);
+	struct page *page, *tmp;
+	int i;
+
+	unregister_shrinker(&sh->shrinker);
+	cancel_work_sync(&sh->refill_work);
+	cancel_work_sync(&sh->zero_work);
+
+	list_for_each_entry_safe(page, tmp, &sh->dirty, lru) {
+		unsigned int order = page_private(page);
+
+		list_del(&page->lru);
+		set_page_private(page, 0);
+		__free_pages(page, order);
+	}
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sh->pools[i]);
+	kfree(sh);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -158,6 +511,47 @@ static struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+static void ion_system_contig_heap_unmap_dma(struct ion_heap *heap,
+					     struct ion_buffer *buffer)
+{
+	if (buffer->sglist)
+		vfree(buffer->sglist);
+}
+
+static struct sg_table *ion_system_contig_heap_map_dma_buf(
+		struct ion_heap *heap, struct ion_buffer *buffer,
+		struct device *dev)
+{
+	struct sg_table *table;
+	int ret;
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+	ret = sg_alloc_table(table, 1, GFP_KERNEL);
+	if (ret) {
+		kfree(table);
+		return ERR_PTR(ret);
+	}
+
+	sg_set_page(table->sgl, virt_to_page(buffer->priv_virt), buffer->size,
+		    0);
+	sg_dma_address(table->sgl) = virt_to_phys(buffer->priv_virt);
+	sg_dma_len(table->sgl) = buffer->size;
+	return table;
+}
+
+static void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					       struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+static void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+						struct ion_buffer *buffer)
+{
+}
+
 static int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -174,10 +568,12 @@ static struct ion_heap_ops kmalloc_ops = {
 	.free = ion_system_contig_heap_free,
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
-	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.unmap_dma = ion_system_contig_heap_unmap_dma,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
+	.map_dma_buf = ion_system_contig_heap_map_dma_buf,
+	.unmap_dma_buf = ion_heap_unmap_dma_buf,
 };
 
 struct ion_heap *ion_system_contig_heap_create(struct ion_platform_heap *unused)
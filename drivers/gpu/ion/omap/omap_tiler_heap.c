@@ -18,6 +18,7 @@
 #include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
+#include <linux/log2.h>
 #include <linux/mm.h>
 #include <linux/omap_ion.h>
 #include <linux/scatterlist.h>
@@ -49,9 +50,9 @@ static int omap_tiler_heap_allocate(struct ion_heap *heap,
 struct omap_tiler_info {
 	struct tiler_block *tiler_handle;	/* handle of the allocation
 						   intiler */
-	bool lump;			/* true for a single lump allocation */
 	u32 n_phys_pages;		/* number of physical pages */
-	u32 *phys_addrs;		/* array addrs of pages */
+	u32 n_runs;			/* number of physical page runs */
+	struct tiler_page_run *runs;	/* contiguous runs of pages */
 	u32 n_tiler_pages;		/* number of tiler pages */
 	u32 *tiler_addrs;		/* array of addrs of tiler pages */
 	int fmt;			/* tiler buffer format */
@@ -62,6 +63,120 @@ struct omap_tiler_info {
 	u32 vstride;			/* virtual size of buffer */
 };
 
+/* largest run we try to carve out if a single lump is not available */
+#define TILER_MAX_RUN_PAGES	256
+
+/* add a run of pages, merging it with the previous run if contiguous */
+static void omap_tiler_add_run(struct omap_tiler_info *info, u32 phys,
+			       u32 npages)
+{
+	struct tiler_page_run *run = info->runs + info->n_runs - 1;
+
+	if (info->n_runs && run->phys + (run->npages << PAGE_SHIFT) == phys) {
+		run->npages += npages;
+		return;
+	}
+
+	run++;
+	run->phys = phys;
+	run->npages = npages;
+	info->n_runs++;
+}
+
+static void omap_tiler_free_runs(struct ion_heap *heap,
+				 struct omap_tiler_info *info)
+{
+	ion_phys_addr_t pages[16];
+	int i, n = 0;
+
+	/* keep single pages for the next fragmented allocation */
+	for (i = 0; i < info->n_runs; i++) {
+		struct tiler_page_run *run = info->runs + i;
+
+		if (run->npages == 1) {
+			pages[n++] = run->phys;
+			if (n < ARRAY_SIZE(pages) && i + 1 < info->n_runs)
+				continue;
+		} else {
+			ion_carveout_free(heap, run->phys,
+					  run->npages << PAGE_SHIFT);
+		}
+
+		if (n) {
+			int put = ion_carveout_reservoir_put(heap, pages, n);
+
+			while (put < n)
+				ion_carveout_free(heap, pages[put++],
+						  PAGE_SIZE);
+			n = 0;
+		}
+	}
+	info->n_runs = 0;
+}
+
+/*
+ * Back the buffer with physical pages: a single lump if possible, after
+ * returning deferred frees and the reservoir to the carveout if needed,
+ * otherwise the largest runs the carveout still has, then single pages
+ * from the reservoir and finally from the carveout.
+ */
+static int omap_tiler_alloc_pages(struct ion_heap *heap,
+				  struct omap_tiler_info *info)
+{
+	u32 left = info->n_phys_pages;
+	u32 chunk = min_t(u32, rounddown_pow_of_two(left),
+			  TILER_MAX_RUN_PAGES);
+	ion_phys_addr_t addr, pages[16];
+	int i, n;
+
+	addr = ion_carveout_allocate(heap, left << PAGE_SHIFT, 0);
+	if (addr == ION_CARVEOUT_ALLOCATE_FAIL &&
+	    ion_heap_freelist_drain(heap, 0))
+		addr = ion_carveout_allocate(heap, left << PAGE_SHIFT, 0);
+	/* reservoir pages may be what keeps the pool from coalescing */
+	if (addr == ION_CARVEOUT_ALLOCATE_FAIL &&
+	    ion_carveout_reservoir_drain(heap))
+		addr = ion_carveout_allocate(heap, left << PAGE_SHIFT, 0);
+	if (addr != ION_CARVEOUT_ALLOCATE_FAIL) {
+		omap_tiler_add_run(info, addr, left);
+		return 0;
+	}
+
+	while (left) {
+		chunk = min_t(u32, chunk, rounddown_pow_of_two(left));
+		if (chunk == 1)
+			break;
+		addr = ion_carveout_allocate(heap, chunk << PAGE_SHIFT, 0);
+		if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
+			chunk >>= 1;
+			continue;
+		}
+		omap_tiler_add_run(info, addr, chunk);
+		left -= chunk;
+	}
+
+	while (left) {
+		n = ion_carveout_reservoir_get(heap, pages,
+					       min_t(u32, left,
+						     ARRAY_SIZE(pages)));
+		if (!n)
+			break;
+		for (i = 0; i < n; i++)
+			omap_tiler_add_run(info, pages[i], 1);
+		left -= n;
+	}
+
+	for (; left; left--) {
+		addr = ion_carveout_allocate(heap, PAGE_SIZE, 0);
+		if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
+			omap_tiler_free_runs(heap, info);
+			return -ENOMEM;
+		}
+		omap_tiler_add_run(info, addr, 1);
+	}
+	return 0;
+}
+
 int omap_tiler_alloc(struct ion_heap *heap,
 		     struct ion_client *client,
 		     struct omap_ion_tiler_alloc_data *data)
@@ -71,10 +186,10 @@ int omap_tiler_alloc(struct ion_heap *heap,
 	struct omap_tiler_info *info = NULL;
 	u32 n_phys_pages;
 	u32 n_tiler_pages;
-	ion_phys_addr_t addr = 0;
 	int i = 0, ret;
 	uint32_t phys_stride, remainder;
 	dma_addr_t ssptr;
+	ktime_t start = ktime_get();
 
 	if (data->fmt == TILFMT_PAGE && data->h != 1) {
 		pr_err("%s: Page mode (1D) allocations must have a height of "
@@ -95,15 +210,15 @@ int omap_tiler_alloc(struct ion_heap *heap,
 	}
 
 	info = kzalloc(sizeof(struct omap_tiler_info) +
-		       sizeof(u32) * n_phys_pages +
+		       sizeof(struct tiler_page_run) * n_phys_pages +
 		       sizeof(u32) * n_tiler_pages, GFP_KERNEL);
 	if (!info)
 		return -ENOMEM;
 
 	info->n_phys_pages = n_phys_pages;
 	info->n_tiler_pages = n_tiler_pages;
-	info->phys_addrs = (u32 *)(info + 1);
-	info->tiler_addrs = info->phys_addrs + n_phys_pages;
+	info->runs = (struct tiler_page_run *)(info + 1);
+	info->tiler_addrs = (u32 *)(info->runs + n_phys_pages);
 	info->fmt = data->fmt;
 
 	/* Allocate tiler space
@@ -114,6 +229,16 @@ int omap_tiler_alloc(struct ion_heap *heap,
 		info->tiler_handle = tiler_reserve_2d(data->fmt, data->w,
 				data->h, PAGE_SIZE);
 
+	/* tiler space may be held by buffers waiting to be freed */
+	if (IS_ERR_OR_NULL(info->tiler_handle) &&
+	    ion_heap_freelist_drain(heap, 0)) {
+		if (data->fmt == TILFMT_PAGE)
+			info->tiler_handle = tiler_reserve_1d(data->w);
+		else
+			info->tiler_handle = tiler_reserve_2d(data->fmt,
+					data->w, data->h, PAGE_SIZE);
+	}
+
 	if (IS_ERR_OR_NULL(info->tiler_handle)) {
 		ret = PTR_ERR(info->tiler_handle);
 		pr_err("%s: failure to allocate address space from tiler\n",
@@ -145,30 +270,17 @@ int omap_tiler_alloc(struct ion_heap *heap,
 		}
 	}
 
-	addr = ion_carveout_allocate(heap, n_phys_pages*PAGE_SIZE, 0);
-	if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
-		for (i = 0; i < n_phys_pages; i++) {
-			addr = ion_carveout_allocate(heap, PAGE_SIZE, 0);
-
-			if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
-				ret = -ENOMEM;
-				pr_err("%s: failed to allocate pages to back "
-					"tiler address space\n", __func__);
-				goto err_got_tiler;
-			}
-			info->phys_addrs[i] = addr;
-		}
-	} else {
-		info->lump = true;
-		for (i = 0; i < n_phys_pages; i++)
-			info->phys_addrs[i] = addr + i*PAGE_SIZE;
+	ret = omap_tiler_alloc_pages(heap, info);
+	if (ret) {
+		pr_err("%s: failed to allocate pages to back "
+			"tiler address space\n", __func__);
+		goto err_got_tiler;
 	}
 
-	ret = tiler_pin_phys(info->tiler_handle, info->phys_addrs,
-			info->n_phys_pages);
+	ret = tiler_pin_runs(info->tiler_handle, info->runs, info->n_runs);
 	if (ret) {
 		pr_err("%s: failure to pin pages to tiler\n", __func__);
-		goto err_got_tiler;
+		goto err_got_pages;
 	}
 
 	data->stride = info->vstride;
@@ -187,24 +299,19 @@ int omap_tiler_alloc(struct ion_heap *heap,
 	buffer->priv_virt = info;
 	data->handle = handle;
 	data->offset = (size_t)(info->tiler_start & ~PAGE_MASK);
+	ion_heap_stats_alloc(buffer->heap, buffer->size, start);
 
 	return 0;
 
 err:
 	tiler_unpin(info->tiler_handle);
+err_got_pages:
+	omap_tiler_free_runs(heap, info);
 err_got_tiler:
 	tiler_release(info->tiler_handle);
-	if (info) {
-		if (info->lump) {
-			ion_carveout_free(heap, addr, n_phys_pages * PAGE_SIZE);
-		} else {
-			for (i -= 1; i >= 0; i--)
-				ion_carveout_free(heap, info->phys_addrs[i],
-						PAGE_SIZE);
-		}
-	}
 err_got_mem:
 	kfree(info);
+	ion_heap_stats_fail(heap, start);
 	return ret;
 }
 
@@ -214,17 +321,7 @@ static void omap_tiler_heap_free(struct ion_buffer *buffer)
 
 	tiler_unpin(info->tiler_handle);
 	tiler_release(info->tiler_handle);
-
-	if (info->lump) {
-		ion_carveout_free(buffer->heap, info->phys_addrs[0],
-				  info->n_phys_pages*PAGE_SIZE);
-	} else {
-		int i;
-		for (i = 0; i < info->n_phys_pages; i++)
-			ion_carveout_free(buffer->heap,
-					  info->phys_addrs[i], PAGE_SIZE);
-	}
-
+	omap_tiler_free_runs(buffer->heap, info);
 	kfree(info);
 }
 
@@ -239,6 +336,36 @@ static int omap_tiler_phys(struct ion_heap *heap,
 	return 0;
 }
 
+/*
+ * 2D buffers are laid out at the container stride, so the buffer is not
+ * linear in tiler space: give importers one entry per tiler page.  Tiler
+ * addresses are not memory and have no struct page.
+ */
+static struct sg_table *omap_tiler_map_dma_buf(struct ion_heap *heap,
+					       struct ion_buffer *buffer,
+					       struct device *dev)
+{
+	struct omap_tiler_info *info = buffer->priv_virt;
+	struct scatterlist *sg;
+	struct sg_table *table;
+	int i, ret;
+
+	table = kzalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+	ret = sg_alloc_table(table, info->n_tiler_pages, GFP_KERNEL);
+	if (ret) {
+		kfree(table);
+		return ERR_PTR(ret);
+	}
+
+	for_each_sg(table->sgl, sg, table->nents, i) {
+		sg_dma_address(sg) = info->tiler_addrs[i];
+		sg_dma_len(sg) = PAGE_SIZE;
+	}
+	return table;
+}
+
 int omap_tiler_pages(struct ion_client *client, struct ion_handle *handle,
 		     int *n, u32 **tiler_addrs)
 {
@@ -300,7 +427,9 @@ static int omap_tiler_heap_map_user(struct ion_heap *heap,
 			ret = remap_pfn_range(vma, addr,
 				 __phys_to_pfn(info->tiler_addrs[i]),
 				PAGE_SIZE,
-				vm_page_prot);
+				(buffer->cached ?
+				(vma->vm_page_prot)
+				: vm_page_prot));
 			if (ret)
 				return ret;
 		}
@@ -308,25 +437,44 @@ static int omap_tiler_heap_map_user(struct ion_heap *heap,
 	return ret;
 }
 
-static void per_cpu_cache_flush_arm(void *arg)
+/*
+ * 1D buffers are linear in tiler space, 2D buffers are mapped page by
+ * page so do the outer maintenance for each tiler page of the range.
+ */
+static void omap_tiler_outer_range(struct ion_buffer *buffer, size_t offset,
+				   size_t len, enum cache_operation op)
 {
-	   flush_cache_all();
+	struct omap_tiler_info *info = buffer->priv_virt;
+
+	if (TILER_PIXEL_FMT_PAGE == info->fmt) {
+		ion_outer_cache_range(info->tiler_addrs[0] + offset,
+				      info->tiler_addrs[0] + offset + len, op);
+		return;
+	}
+
+	while (len) {
+		u32 page_offs = offset & ~PAGE_MASK;
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - page_offs);
+		u32 addr = info->tiler_addrs[offset >> PAGE_SHIFT] + page_offs;
+
+		ion_outer_cache_range(addr, addr + chunk, op);
+		offset += chunk;
+		len -= chunk;
+	}
 }
 
-static int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
-			unsigned long vaddr, enum cache_operation cacheop)
+static int omap_tiler_heap_sync_user(struct ion_buffer *buffer,
+				     unsigned long vaddr,
+				     struct ion_cache_range *ranges,
+				     unsigned int nr, enum cache_operation op)
 {
 	struct omap_tiler_info *info;
-	int n_pages;
+	unsigned int i;
 
 	if (!buffer) {
 		pr_err("%s(): buffer is NULL\n", __func__);
 		return -EINVAL;
 	}
-	if (!buffer->cached) {
-		pr_err("%s(): buffer not mapped as cacheable\n", __func__);
-		return -EINVAL;
-	}
 
 	info = buffer->priv_virt;
 	if (!info) {
@@ -334,45 +482,36 @@ static int omap_tiler_cache_operation(struct ion_buffer *buffer, size_t len,
 		return -EINVAL;
 	}
 
-	n_pages = info->n_tiler_pages;
-	if (len > (n_pages * PAGE_SIZE)) {
-		pr_err("%s(): size to flush is greater than allocated size\n",
-				__func__);
-		return -EINVAL;
-	}
-
-	if (TILER_PIXEL_FMT_PAGE != info->fmt) {
-		pr_err("%s(): only TILER 1D buffers can be cached\n", __func__);
-		return -EINVAL;
-	}
-
-	if (len > FULL_CACHE_FLUSH_THRESHOLD) {
-		on_each_cpu(per_cpu_cache_flush_arm, NULL, 1);
-		outer_flush_all();
-		return 0;
+	for (i = 0; i < nr; i++) {
+		if (ranges[i].offset + ranges[i].len < ranges[i].offset ||
+		    ranges[i].offset + ranges[i].len >
+		    info->n_tiler_pages * PAGE_SIZE) {
+			pr_err("%s(): range is outside of the buffer\n",
+			       __func__);
+			return -EINVAL;
+		}
 	}
 
-	__cpuc_coherent_user_range((vaddr) & PAGE_MASK, PAGE_ALIGN(vaddr+len));
-
-	if (cacheop == CACHE_FLUSH)
-		outer_flush_range(info->tiler_addrs[0],
-				info->tiler_addrs[0] + len);
-	else
-		outer_inv_range(info->tiler_addrs[0],
-				info->tiler_addrs[0] + len);
-	return 0;
+	return ion_cache_sync_ranges(buffer, vaddr, ranges, nr, op,
+				     omap_tiler_outer_range);
 }
 
 static int omap_tiler_heap_flush_user(struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_FLUSH);
+	struct ion_cache_range range = { .offset = 0, .len = len };
+
+	return omap_tiler_heap_sync_user(buffer, vaddr, &range, 1,
+					 CACHE_FLUSH);
 }
 
 static int omap_tiler_heap_inval_user(struct ion_buffer *buffer, size_t len,
 			unsigned long vaddr)
 {
-	return omap_tiler_cache_operation(buffer, len, vaddr, CACHE_INVALIDATE);
+	struct ion_cache_range range = { .offset = 0, .len = len };
+
+	return omap_tiler_heap_sync_user(buffer, vaddr, &range, 1,
+					 CACHE_INVALIDATE);
 }
 
 static struct ion_heap_ops omap_tiler_ops = {
@@ -382,6 +521,10 @@ static struct ion_heap_ops omap_tiler_ops = {
 	.map_user = omap_tiler_heap_map_user,
 	.flush_user = omap_tiler_heap_flush_user,
 	.inval_user = omap_tiler_heap_inval_user,
+	.sync_user = omap_tiler_heap_sync_user,
+	.free_info = ion_carveout_free_info,
+	.map_dma_buf = omap_tiler_map_dma_buf,
+	.unmap_dma_buf = ion_heap_unmap_dma_buf,
 };
 
 struct ion_heap *omap_tiler_heap_create(struct ion_platform_heap *data)
@@ -400,5 +543,5 @@ struct ion_heap *omap_tiler_heap_create(struct ion_platform_heap *data)
 
 void omap_tiler_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	ion_carveout_heap_destroy(heap);
 }
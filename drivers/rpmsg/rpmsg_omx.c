@@ -37,6 +37,8 @@
 #include <linux/completion.h>
 #include <linux/remoteproc.h>
 #include <linux/fdtable.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
 
 #ifdef CONFIG_ION_OMAP
 #include <linux/ion.h>
@@ -48,6 +50,9 @@ extern struct ion_device *omap_ion_device;
 /* maximum OMX devices this driver can handle */
 #define MAX_OMX_DEVICES		8
 
+/* buckets of the per-instance ion handle to device address cache */
+#define OMX_DA_CACHE_BITS	5
+
 enum rpc_omx_map_info_type {
 	RPC_OMX_MAP_INFO_NONE          = 0,
 	RPC_OMX_MAP_INFO_ONE_BUF       = 1,
@@ -81,9 +86,21 @@ struct rpmsg_omx_instance {
 	int state;
 #ifdef CONFIG_ION_OMAP
 	struct ion_client *ion_client;
+	spinlock_t da_lock;
+	u32 da_gen;
+	struct hlist_head da_cache[1 << OMX_DA_CACHE_BITS];
 #endif
 };
 
+#ifdef CONFIG_ION_OMAP
+/* translation of an ion handle of this instance to a remote device address */
+struct rpmsg_omx_da {
+	struct hlist_node node;
+	struct ion_handle *handle;
+	u32 da;
+};
+#endif
+
 static struct class *rpmsg_omx_class;
 static dev_t rpmsg_omx_dev;
 
@@ -116,6 +133,95 @@ static int _rpmsg_pa_to_da(struct rpmsg_omx_instance *omx, u32 pa, u32 *da)
 
 	return ret;
 }
+
+static struct rpmsg_omx_da *_rpmsg_omx_da_find(struct rpmsg_omx_instance *omx,
+					       struct ion_handle *handle)
+{
+	struct rpmsg_omx_da *entry;
+	struct hlist_node *pos;
+	struct hlist_head *head =
+		&omx->da_cache[hash_ptr(handle, OMX_DA_CACHE_BITS)];
+
+	hlist_for_each_entry(entry, pos, head, node)
+		if (entry->handle == handle)
+			return entry;
+	return NULL;
+}
+
+static bool _rpmsg_omx_da_get(struct rpmsg_omx_instance *omx,
+			      struct ion_handle *handle, u32 *da, u32 *gen)
+{
+	struct rpmsg_omx_da *entry;
+
+	spin_lock(&omx->da_lock);
+	entry = _rpmsg_omx_da_find(omx, handle);
+	if (entry)
+		*da = entry->da;
+	*gen = omx->da_gen;
+	spin_unlock(&omx->da_lock);
+
+	return entry != NULL;
+}
+
+/*
+ * handle must have been validated against omx->ion_client after gen was
+ * read.  If a handle was freed since, it may have been the one validated,
+ * so skip caching it.
+ */
+static void _rpmsg_omx_da_add(struct rpmsg_omx_instance *omx,
+			      struct ion_handle *handle, u32 da, u32 gen)
+{
+	struct rpmsg_omx_da *entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+
+	/* the cache is only an optimization */
+	if (!entry)
+		return;
+	entry->handle = handle;
+	entry->da = da;
+
+	spin_lock(&omx->da_lock);
+	if (gen != omx->da_gen || _rpmsg_omx_da_find(omx, handle)) {
+		spin_unlock(&omx->da_lock);
+		kfree(entry);
+		return;
+	}
+	hlist_add_head(&entry->node,
+		&omx->da_cache[hash_ptr(handle, OMX_DA_CACHE_BITS)]);
+	spin_unlock(&omx->da_lock);
+}
+
+/* must be called before the handle is freed, as its address may be reused */
+static void _rpmsg_omx_da_remove(struct rpmsg_omx_instance *omx,
+				 struct ion_handle *handle)
+{
+	struct rpmsg_omx_da *entry;
+
+	spin_lock(&omx->da_lock);
+	entry = _rpmsg_omx_da_find(omx, handle);
+	if (entry)
+		hlist_del(&entry->node);
+	omx->da_gen++;
+	spin_unlock(&omx->da_lock);
+
+	kfree(entry);
+}
+
+static void _rpmsg_omx_da_flush(struct rpmsg_omx_instance *omx)
+{
+	struct rpmsg_omx_da *entry;
+	struct hlist_node *pos, *n;
+	int i;
+
+	spin_lock(&omx->da_lock);
+	for (i = 0; i < ARRAY_SIZE(omx->da_cache); i++) {
+		hlist_for_each_entry_safe(entry, pos, n, &omx->da_cache[i],
+					  node) {
+			hlist_del(&entry->node);
+			kfree(entry);
+		}
+	}
+	spin_unlock(&omx->da_lock);
+}
 #endif
 
 static int _rpmsg_omx_buffer_lookup(struct rpmsg_omx_instance *omx,
@@ -130,10 +236,16 @@ static int _rpmsg_omx_buffer_lookup(struct rpmsg_omx_instance *omx,
 		struct ion_handle *handle;
 		ion_phys_addr_t paddr;
 		size_t unused;
+		u32 gen;
 
 		handle = (struct ion_handle *)buffer;
+		if (_rpmsg_omx_da_get(omx, handle, va, &gen))
+			return 0;
+
 		if (!ion_phys(omx->ion_client, handle, &paddr, &unused)) {
 			ret = _rpmsg_pa_to_da(omx, (phys_addr_t)paddr, va);
+			if (!ret)
+				_rpmsg_omx_da_add(omx, handle, *va, gen);
 			goto exit;
 		}
 	}
@@ -415,7 +527,13 @@ long rpmsg_omx_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				_IOC_NR(cmd), ret);
 			return -EFAULT;
 		}
+		/*
+		 * invalidate before and after the free, so neither a cached
+		 * nor a concurrently validated translation outlives it
+		 */
+		_rpmsg_omx_da_remove(omx, data.handle);
 		ion_free(omx->ion_client, data.handle);
+		_rpmsg_omx_da_remove(omx, data.handle);
 		if (copy_to_user((char __user *) arg, &data, sizeof(data))) {
 			dev_err(omxserv->dev,
 				"%s: %d: copy_to_user fail: %d\n", __func__,
@@ -483,6 +601,7 @@ static int rpmsg_omx_open(struct inode *inode, struct file *filp)
 	mutex_unlock(&omxserv->lock);
 
 #ifdef CONFIG_ION_OMAP
+	spin_lock_init(&omx->da_lock);
 	omx->ion_client = ion_client_create(omap_ion_device,
 					    (1 << ION_HEAP_TYPE_CARVEOUT) |
 					    (1 << OMAP_ION_HEAP_TYPE_TILER),
@@ -541,6 +660,7 @@ static int rpmsg_omx_release(struct inode *inode, struct file *filp)
 	}
 
 #ifdef CONFIG_ION_OMAP
+	_rpmsg_omx_da_flush(omx);
 	ion_client_destroy(omx->ion_client);
 #endif
 	mutex_lock(&omxserv->lock);
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_SHARED_MEM	= B_PACK_CHARS('s', 'm', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,17 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_SHARED_MEM object lets a large payload that already lives
+ * in shared memory (an ashmem region or a dma-buf) travel without being
+ * copied.  The sender puts the fd of the region in 'handle' and the number
+ * of bytes to share in 'cookie'.  Instead of installing an fd, the driver
+ * maps the region read-only into the receiver when the transaction is read
+ * and stores the address in 'binder'.  The mapping goes away with
+ * BC_FREE_BUFFER.  Like fds, it is only accepted by targets that accept
+ * fds.
+ */
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
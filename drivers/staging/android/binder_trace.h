@@ -0,0 +1,119 @@
+#if !defined(_BINDER_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H_
+
+#include <linux/stringify.h>
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+#define TRACE_SYSTEM_STRING __stringify(TRACE_SYSTEM)
+#define TRACE_INCLUDE_FILE binder_trace
+
+TRACE_EVENT(binder_transaction,
+	    TP_PROTO(int debug_id, int reply, int from_proc, int to_proc,
+		     int to_thread, size_t size),
+	    TP_ARGS(debug_id, reply, from_proc, to_proc, to_thread, size),
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, reply)
+		    __field(int, from_proc)
+		    __field(int, to_proc)
+		    __field(int, to_thread)
+		    __field(size_t, size)
+		    ),
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->reply = reply;
+		    __entry->from_proc = from_proc;
+		    __entry->to_proc = to_proc;
+		    __entry->to_thread = to_thread;
+		    __entry->size = size;
+		    ),
+	    TP_printk("transaction=%d %s %d -> %d:%d, %zu bytes",
+		      __entry->debug_id, __entry->reply ? "reply" : "call",
+		      __entry->from_proc, __entry->to_proc, __entry->to_thread,
+		      __entry->size)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	    TP_PROTO(int debug_id, int proc, int thread, u32 queue_us),
+	    TP_ARGS(debug_id, proc, thread, queue_us),
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, proc)
+		    __field(int, thread)
+		    __field(u32, queue_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->proc = proc;
+		    __entry->thread = thread;
+		    __entry->queue_us = queue_us;
+		    ),
+	    TP_printk("transaction=%d received by %d:%d after %u us",
+		      __entry->debug_id, __entry->proc, __entry->thread,
+		      __entry->queue_us)
+);
+
+TRACE_EVENT(binder_reply,
+	    TP_PROTO(int debug_id, int proc, u32 reply_us),
+	    TP_ARGS(debug_id, proc, reply_us),
+	    TP_STRUCT__entry(
+		    __field(int, debug_id)
+		    __field(int, proc)
+		    __field(u32, reply_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->debug_id = debug_id;
+		    __entry->proc = proc;
+		    __entry->reply_us = reply_us;
+		    ),
+	    TP_printk("transaction=%d answered by %d after %u us",
+		      __entry->debug_id, __entry->proc, __entry->reply_us)
+);
+
+TRACE_EVENT(binder_alloc_buf,
+	    TP_PROTO(int proc, size_t size, int failed, u32 alloc_us),
+	    TP_ARGS(proc, size, failed, alloc_us),
+	    TP_STRUCT__entry(
+		    __field(int, proc)
+		    __field(size_t, size)
+		    __field(int, failed)
+		    __field(u32, alloc_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->proc = proc;
+		    __entry->size = size;
+		    __entry->failed = failed;
+		    __entry->alloc_us = alloc_us;
+		    ),
+	    TP_printk("proc %d, %zu bytes %s in %u us", __entry->proc,
+		      __entry->size, __entry->failed ? "failed" : "allocated",
+		      __entry->alloc_us)
+);
+
+TRACE_EVENT(binder_proc_starved,
+	    TP_PROTO(int proc, int requested_threads, int max_threads),
+	    TP_ARGS(proc, requested_threads, max_threads),
+	    TP_STRUCT__entry(
+		    __field(int, proc)
+		    __field(int, requested_threads)
+		    __field(int, max_threads)
+		    ),
+	    TP_fast_assign(
+		    __entry->proc = proc;
+		    __entry->requested_threads = requested_threads;
+		    __entry->max_threads = max_threads;
+		    ),
+	    TP_printk("proc %d has no ready thread, %d requested, max %d",
+		      __entry->proc, __entry->requested_threads,
+		      __entry->max_threads)
+);
+
+#endif /* _BINDER_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
@@ -21,6 +21,8 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
@@ -33,17 +35,25 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Positions in the log (w_off, head and the readers' r_off) only ever grow;
+ * logger_offset() maps them into the ring. The ring holds the entries between
+ * 'head' and 'w_off'. Writers append under the write side of 'lock' and never
+ * look at the readers. A reader whose position falls behind 'head' was lapped
+ * and notices so itself. Readers only ever take the read side of 'lock', so
+ * they can not hold up a writer. The mutex 'mutex' protects the list of
+ * readers and their state.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	seqlock_t		lock;	/* writers, w_off and head */
+	u64			w_off;	/* current write head position */
+	u64			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -56,13 +66,24 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	u64			r_off;	/* current read head position */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	bool			r_batch; /* read() returns many entries */
+};
+
+/*
+ * struct logger_staging - per-CPU buffer a writer copies its payload into
+ * before it locks the log, so the log is only ever locked for a memcpy.
+ */
+struct logger_staging {
+	unsigned char		msg[LOGGER_ENTRY_MAX_PAYLOAD];
 };
 
+static struct logger_staging __percpu *logger_staging;
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
-size_t logger_offset(struct logger_log *log, size_t n)
+size_t logger_offset(struct logger_log *log, u64 n)
 {
 	return n & (log->size-1);
 }
@@ -120,7 +141,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * In the log, the length does not include the size of the log entry structure.
  * This function returns the size including the log entry structure.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -164,18 +185,92 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_lapped - has the writer overwritten the entry at position 'off'?
+ *
+ * Caller must be inside a read or write section of log->lock.
+ */
+static inline bool logger_lapped(struct logger_log *log, u64 off)
+{
+	return off < log->head;
+}
+
+/*
+ * peek_next_entry - find the next entry 'reader' may read and copy its header
+ * into 'entry'. Readers that were lapped are pulled forward to log->head, and
+ * readers without 'r_all' skip over entries written by other users.
+ *
+ * Returns false if there is nothing to read. Caller must hold log->mutex.
+ */
+static bool peek_next_entry(struct logger_log *log,
+			    struct logger_reader *reader,
+			    struct logger_entry *entry)
+{
+	uid_t euid = current_euid();
+	unsigned seq;
+	u64 off;
+	bool ret;
+
+	while (1) {
+		do {
+			seq = read_seqbegin(&log->lock);
+			off = reader->r_off;
+			if (logger_lapped(log, off))
+				off = log->head;
+			ret = (off != log->w_off);
+			if (ret)
+				*entry = *get_entry_header(log,
+					logger_offset(log, off), entry);
+		} while (read_seqretry(&log->lock, seq));
+
+		reader->r_off = off;
+		if (!ret || reader->r_all || entry->euid == euid)
+			return ret;
+
+		reader->r_off += sizeof(struct logger_entry) + entry->len;
+	}
+}
+
+/*
+ * advance_reader - move 'reader' past 'entry', which it has just copied out
+ * of the log. Returns false if a writer lapped the reader during the copy,
+ * in which case what was copied may be torn and must be discarded.
+ *
+ * Caller must hold log->mutex.
+ */
+static bool advance_reader(struct logger_log *log,
+			   struct logger_reader *reader,
+			   struct logger_entry *entry)
+{
+	unsigned seq;
+	bool lapped;
+
+	/* the copy must be complete before we look for a lapping writer */
+	smp_rmb();
+	do {
+		seq = read_seqbegin(&log->lock);
+		lapped = logger_lapped(log, reader->r_off);
+	} while (read_seqretry(&log->lock, seq));
+
+	if (lapped)
+		return false;
+
+	reader->r_off += sizeof(struct logger_entry) + entry->len;
+	return true;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes of the entry 'entry'
+ * found at the reader's position into the user-space buffer 'buf'. Returns
+ * 'count' on success. The reader's position is not moved.
  *
  * Caller must hold log->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_entry *entry,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -183,7 +278,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
@@ -209,36 +303,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
-
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
-/*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
- */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
-
-		if (entry->euid == euid)
-			return off;
-
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
-
-	return off;
-}
-
 /*
  * logger_read - our log's read() method
  *
@@ -247,6 +314,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *	- O_NONBLOCK works
  *	- If there are no log entries to read, blocks until log is written to
  *	- Atomically reads exactly one log entry
+ *	- In batch mode, also reads as many whole entries after the first as
+ *	  fit in the buffer, without blocking
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -256,6 +325,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -265,7 +335,7 @@ start:
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		ret = !peek_next_entry(log, reader, &entry);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -289,175 +359,142 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!peek_next_entry(log, reader, &entry))) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
+	ret = do_read_log_to_user(log, reader, &entry, buf, ret);
+	if (ret < 0)
+		goto out;
 
-	return ret;
-}
+	/* were we lapped while copying? then the copy may be torn */
+	if (unlikely(!advance_reader(log, reader, &entry))) {
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
 
-/*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
- */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
-{
-	size_t count = 0;
+	/*
+	 * In batch mode, keep going while whole entries fit. Anything that
+	 * goes wrong past the first entry just ends the batch early.
+	 */
+	while (reader->r_batch && peek_next_entry(log, reader, &entry)) {
+		ssize_t len = get_user_hdr_len(reader->r_ver) + entry.len;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+		if (count - ret < len)
+			break;
 
-	return off;
-}
+		len = do_read_log_to_user(log, reader, &entry, buf + ret, len);
+		if (len < 0 || !advance_reader(log, reader, &entry))
+			break;
 
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
- */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+		ret += len;
 	}
 
-	return 0;
+out:
+	mutex_unlock(&log->mutex);
+
+	return ret;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * copy_to_log - copies 'count' bytes from 'buf' into 'log' at position 'pos'
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void copy_to_log(struct logger_log *log, u64 pos, const void *buf,
+			size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
+	size_t off = logger_offset(log, pos);
+	size_t len;
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - appends the entry 'header', followed by its payload 'msg',
+ * to 'log'. First moves log->head past the entries the new one overwrites,
+ * so that readers still positioned on them see that they were lapped.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock for writing.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, struct logger_entry *header,
+			 const void *msg)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	size_t len = sizeof(struct logger_entry) + header->len;
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+	while (log->w_off + len - log->head > log->size)
+		log->head += sizeof(struct logger_entry) +
+			get_entry_msg_len(log, logger_offset(log, log->head));
 
-	log->w_off = logger_offset(log, log->w_off + count);
+	copy_to_log(log, log->w_off, header, sizeof(struct logger_entry));
+	copy_to_log(log, log->w_off + sizeof(struct logger_entry), msg,
+		    header->len);
 
+	log->w_off += len;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * copy_iov_from_user - gathers 'count' bytes from the user-space vector 'iov'
+ * into 'buf'. With 'atomic' set this never sleeps, and fails instead of
+ * faulting in pages that are not resident.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_iov_from_user(void *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count, bool atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+	while (count && nr_segs-- > 0) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len) ||
+			    __copy_from_user_inatomic(buf, iov->iov_base, len))
+				return -EFAULT;
+		} else if (copy_from_user(buf, iov->iov_base, len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log, log->w_off + count);
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is gathered into this CPU's staging buffer with page faults
+ * disabled, and the log is only locked to copy it in. If the user pages are
+ * not resident, we fall back to a private buffer and take the faults before
+ * locking. Writers never wait for readers.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	bool staged = true;
+	void *msg;
+	int ret;
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -466,43 +503,45 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	msg = get_cpu_ptr(logger_staging)->msg;
+	pagefault_disable();
+	ret = copy_iov_from_user(msg, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		put_cpu_ptr(logger_staging);
+		staged = false;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+		msg = kmalloc(header.len, GFP_KERNEL);
+		if (!msg)
+			return -ENOMEM;
+		if (copy_iov_from_user(msg, iov, nr_segs, header.len, false)) {
+			kfree(msg);
+			return -EFAULT;
+		}
+	}
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	write_seqlock(&log->lock);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	/* stamp the entry under the lock, so the log stays in time order */
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	do_write_log(log, &header, msg);
 
-		iov++;
-		ret += nr;
-	}
+	write_sequnlock(&log->lock);
 
-	mutex_unlock(&log->mutex);
+	if (staged)
+		put_cpu_ptr(logger_staging);
+	else
+		kfree(msg);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/* wake up any blocked readers; pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -515,6 +554,7 @@ static struct logger_log *get_log_from_minor(int);
 static int logger_open(struct inode *inode, struct file *file)
 {
 	struct logger_log *log;
+	unsigned seq;
 	int ret;
 
 	ret = nonseekable_open(inode, file);
@@ -534,13 +574,17 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		do {
+			seq = read_seqbegin(&log->lock);
+			reader->r_off = log->head;
+		} while (read_seqretry(&log->lock, seq));
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -585,6 +629,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -596,11 +641,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (peek_next_entry(log, reader, &entry))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -620,12 +661,25 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+static long logger_set_batch(struct logger_reader *reader, void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	reader->r_batch = !!batch;
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
+	unsigned seq;
+	u64 off;
 
 	mutex_lock(&log->mutex);
 
@@ -639,10 +693,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		do {
+			seq = read_seqbegin(&log->lock);
+			off = reader->r_off;
+			if (logger_lapped(log, off))
+				off = log->head;
+			ret = log->w_off - off;
+		} while (read_seqretry(&log->lock, seq));
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -651,13 +708,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (peek_next_entry(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -666,9 +718,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* readers find themselves lapped and move up to the new head */
+		write_seqlock(&log->lock);
 		log->head = log->w_off;
+		write_sequnlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -687,6 +740,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_batch(reader, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -723,6 +784,7 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SEQLOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -767,6 +829,10 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_staging = alloc_percpu(struct logger_staging);
+	if (!logger_staging)
+		return -ENOMEM;
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -17,6 +17,20 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Thread group leaders are kept in buckets by oom_score_adj, updated on fork,
+ * exit, exec and oom_score_adj changes, so picking a victim only looks at the
+ * tasks in the highest eligible bucket instead of walking every process.
+ *
+ * With /sys/module/lowmemorykiller/parameters/predict set, the thresholds are
+ * raised ahead of time while memory is draining. The driver samples the page
+ * allocation rate, the share of scanned pages that reclaim manages to free and
+ * how full swap (usually zram) is. It raises each minfree level by the memory
+ * reclaim is not expected to give back over predict_horizon_ms. Once swap is
+ * fuller than predict_swap_full_pct, anonymous memory can no longer be pushed
+ * out, so the levels are raised further. They are never raised above
+ * predict_max_pct percent of the configured values. Every sample, threshold
+ * decision and kill is reported through tracepoints.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -37,6 +51,14 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/math64.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -56,20 +78,278 @@ static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
 
+static uint32_t lowmem_predict;
+static uint32_t lowmem_predict_horizon_ms = 1000;
+static uint32_t lowmem_predict_max_pct = 200;
+static uint32_t lowmem_predict_swap_full_pct = 80;
+
+/*
+ * Pressure estimate for the predict mode, resampled at most every
+ * LOWMEM_PREDICT_INTERVAL. Rates are averaged over the last few samples.
+ */
+#define LOWMEM_PREDICT_INTERVAL	(HZ / 10)
+
+static struct {
+	struct mutex lock;		/* serializes sampling */
+	unsigned long last;		/* jiffies at the last sample */
+	unsigned long alloc;		/* pages allocated at the last sample */
+	unsigned long scan;		/* pages scanned at the last sample */
+	unsigned long steal;		/* pages reclaimed at the last sample */
+	unsigned int alloc_rate;	/* pages allocated per second */
+	unsigned int efficiency;	/* percent of scanned pages reclaimed */
+	unsigned int swap_fill;		/* percent of swap in use */
+} lowmem_predictor = {
+	.lock = __MUTEX_INITIALIZER(lowmem_predictor.lock),
+	.efficiency = 100,
+};
+
+/*
+ * Buckets of thread group leaders, 32 oom_score_adj values wide. The values
+ * the Android framework hands out are further apart than that, so in practice
+ * each bucket holds a single adj.
+ *
+ * lowmem_bucket_lock nests inside tasklist_lock and siglock. Nothing that
+ * takes task_lock() or siglock may be called with it held.
+ */
+#define LOWMEM_BUCKET_SHIFT	5
+#define LOWMEM_BUCKETS \
+	(((OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN) >> LOWMEM_BUCKET_SHIFT) + 1)
+
+/* tasks of one adj whose size is sampled per pass */
+#define LOWMEM_SAMPLE		32
+
+static struct hlist_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/* leader of the last victim, until it exits; protected by lowmem_bucket_lock */
+static struct task_struct *lowmem_deathpending;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+static inline int lowmem_bucket_index(int oom_score_adj)
+{
+	return (oom_score_adj - OOM_SCORE_ADJ_MIN) >> LOWMEM_BUCKET_SHIFT;
+}
+
+static inline struct hlist_head *lowmem_bucket(int oom_score_adj)
+{
+	return &lowmem_buckets[lowmem_bucket_index(oom_score_adj)];
+}
+
+/* called with tasklist_lock held for writing */
+void lowmem_task_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	hlist_add_head(&p->lowmem_node, lowmem_bucket(p->signal->oom_score_adj));
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* called with tasklist_lock held for writing */
+void lowmem_task_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	hlist_del_init(&p->lowmem_node);
+	if (p == lowmem_deathpending)
+		lowmem_deathpending = NULL;
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* a thread other than the leader exec()ed and takes over as leader */
+void lowmem_task_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	hlist_del_init(&old->lowmem_node);
+	hlist_add_head(&new->lowmem_node,
+		       lowmem_bucket(new->signal->oom_score_adj));
+	if (old == lowmem_deathpending)
+		lowmem_deathpending = new;
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/* move 'task's thread group to the bucket of its current oom_score_adj */
+void lowmem_adj_update(struct task_struct *task)
+{
+	struct task_struct *p;
+	unsigned long flags;
+
+	rcu_read_lock();
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	p = task->group_leader;
+	if (!hlist_unhashed(&p->lowmem_node)) {
+		hlist_del(&p->lowmem_node);
+		hlist_add_head(&p->lowmem_node,
+			       lowmem_bucket(p->signal->oom_score_adj));
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * lowmem_collect - find the highest oom_score_adj between 'min_score_adj' and
+ * 'max_score_adj' that any user process has, and take a reference on up to
+ * LOWMEM_SAMPLE of the thread group leaders with that adj.
+ *
+ * Returns the number of tasks stored in 'tasks', and their adj in 'adj'.
+ */
+static int lowmem_collect(int min_score_adj, int max_score_adj,
+			  struct task_struct **tasks, int *adj)
+{
+	struct hlist_head *bucket;
+	struct hlist_node *pos;
+	struct task_struct *p;
+	unsigned long flags;
+	int i, n = 0;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	for (i = lowmem_bucket_index(max_score_adj);
+	     i >= lowmem_bucket_index(min_score_adj); i--) {
+		bucket = &lowmem_buckets[i];
+		*adj = min_score_adj - 1;
+		hlist_for_each_entry(p, pos, bucket, lowmem_node) {
+			int oom_score_adj = p->signal->oom_score_adj;
+
+			if (p->flags & PF_KTHREAD)
+				continue;
+			if (oom_score_adj > *adj &&
+			    oom_score_adj <= max_score_adj)
+				*adj = oom_score_adj;
+		}
+		if (*adj < min_score_adj)
+			continue;
+
+		hlist_for_each_entry(p, pos, bucket, lowmem_node) {
+			if (p->flags & PF_KTHREAD ||
+			    p->signal->oom_score_adj != *adj)
+				continue;
+			get_task_struct(p);
+			tasks[n++] = p;
+			if (n == LOWMEM_SAMPLE)
+				break;
+		}
+		break;
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+	return n;
+}
+
+/* vm events as of the last sample, under lowmem_predictor.lock */
+static unsigned long lowmem_events[NR_VM_EVENT_ITEMS];
+
+/* sum a per-zone vm event, named by its _NORMAL item, over all zones */
+static unsigned long lowmem_zone_events(enum vm_event_item normal)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < MAX_NR_ZONES; i++)
+		sum += lowmem_events[normal - ZONE_NORMAL + i];
+	return sum;
+}
+
+static void lowmem_predict_sample(void)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed, alloc, scan, steal;
+
+	/* all_vm_events() may sleep, and one sampler is enough */
+	if (!mutex_trylock(&lowmem_predictor.lock))
+		return;
+
+	elapsed = now - lowmem_predictor.last;
+	if (elapsed < LOWMEM_PREDICT_INTERVAL)
+		goto out;
+
+	all_vm_events(lowmem_events);
+	alloc = lowmem_zone_events(PGALLOC_NORMAL);
+	scan = lowmem_zone_events(PGSCAN_KSWAPD_NORMAL) +
+		lowmem_zone_events(PGSCAN_DIRECT_NORMAL);
+	steal = lowmem_zone_events(PGSTEAL_KSWAPD_NORMAL) +
+		lowmem_zone_events(PGSTEAL_DIRECT_NORMAL);
+
+	/* after a long quiet spell, just start over from here */
+	if (lowmem_predictor.last && elapsed <= 10 * HZ) {
+		unsigned int rate, efficiency = 100;
+
+		rate = div_u64((u64)(alloc - lowmem_predictor.alloc) * HZ,
+			       elapsed);
+		if (scan != lowmem_predictor.scan)
+			efficiency = min_t(unsigned long, 100,
+					   (steal - lowmem_predictor.steal) *
+					   100 / (scan - lowmem_predictor.scan));
+
+		lowmem_predictor.alloc_rate =
+			(lowmem_predictor.alloc_rate * 3 + rate) / 4;
+		lowmem_predictor.efficiency =
+			(lowmem_predictor.efficiency * 3 + efficiency) / 4;
+	}
+
+	lowmem_predictor.last = now;
+	lowmem_predictor.alloc = alloc;
+	lowmem_predictor.scan = scan;
+	lowmem_predictor.steal = steal;
+	lowmem_predictor.swap_fill = 0;
+	if (total_swap_pages > 0)
+		lowmem_predictor.swap_fill = (total_swap_pages -
+			nr_swap_pages) * 100 / total_swap_pages;
+
+	trace_lowmem_pressure(lowmem_predictor.alloc_rate,
+			      lowmem_predictor.efficiency,
+			      lowmem_predictor.swap_fill);
+out:
+	mutex_unlock(&lowmem_predictor.lock);
+}
+
+/*
+ * lowmem_predict_minfree - raise the configured threshold 'minfree' by what
+ * we expect to lose before reclaim catches up.
+ */
+static int lowmem_predict_minfree(int minfree)
+{
+	unsigned int efficiency = lowmem_predictor.efficiency;
+	unsigned int swap_fill = lowmem_predictor.swap_fill;
+	unsigned int full = lowmem_predict_swap_full_pct;
+	unsigned long max, shortfall;
+
+	/* allocations over the horizon that reclaim does not give back */
+	shortfall = div_u64((u64)lowmem_predictor.alloc_rate *
+			    lowmem_predict_horizon_ms * (100 - efficiency),
+			    100 * MSEC_PER_SEC);
+
+	/* with swap filling up, anonymous memory is no longer reclaimable */
+	if (full < 100 && swap_fill > full)
+		shortfall += (unsigned long)minfree * (swap_fill - full) /
+			(100 - full);
+
+	max = (unsigned long)minfree * max_t(u32, lowmem_predict_max_pct, 100)
+		/ 100;
+	return min(minfree + shortfall, max);
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *tsk;
+	struct task_struct *tasks[LOWMEM_SAMPLE];
 	struct task_struct *selected = NULL;
+	struct task_struct *selected_leader = NULL;
+	unsigned long flags;
 	int rem = 0;
 	int tasksize;
-	int i;
+	int i, n;
 	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int static_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int max_score_adj = OOM_SCORE_ADJ_MAX;
+	int minfree = 0, static_minfree = 0;
+	int oom_score_adj;
 	int selected_tasksize = 0;
 	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
@@ -81,17 +361,29 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	if (lowmem_predict)
+		lowmem_predict_sample();
 	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
+		static_minfree = minfree = lowmem_minfree[i];
+		if (lowmem_predict)
+			minfree = lowmem_predict_minfree(minfree);
+		if (static_score_adj == OOM_SCORE_ADJ_MAX + 1 &&
+		    other_free < static_minfree &&
+		    other_file < static_minfree)
+			static_score_adj = lowmem_adj[i];
+		if (other_free < minfree &&
+		    other_file < minfree) {
 			min_score_adj = lowmem_adj[i];
 			break;
 		}
 	}
-	if (sc->nr_to_scan > 0)
+	if (sc->nr_to_scan > 0) {
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 				sc->nr_to_scan, sc->gfp_mask, other_free,
 				other_file, min_score_adj);
+		trace_lowmem_threshold(other_free, other_file, minfree,
+				       static_minfree, min_score_adj);
+	}
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -103,58 +395,70 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_score_adj = min_score_adj;
 
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+		return 0;
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+	/*
+	 * Walk down from the highest adj in use. Only the tasks sharing that
+	 * adj have their size sampled; if none of them has any memory left,
+	 * try the next lower adj.
+	 */
+	while (!selected && max_score_adj >= min_score_adj) {
+		n = lowmem_collect(min_score_adj, max_score_adj, tasks,
+				   &oom_score_adj);
+		if (!n)
+			break;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+		for (i = 0; i < n; i++) {
+			struct task_struct *p = find_lock_task_mm(tasks[i]);
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+			if (!p)
 				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+			tasksize = get_mm_rss(p->mm);
+			if (tasksize <= 0 || tasksize <= selected_tasksize) {
+				task_unlock(p);
 				continue;
+			}
+			get_task_struct(p);
+			task_unlock(p);
+
+			if (selected)
+				put_task_struct(selected);
+			selected = p;
+			selected_leader = tasks[i];
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_score_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
+
+		for (i = 0; i < n; i++)
+			put_task_struct(tasks[i]);
+		max_score_adj = oom_score_adj - 1;
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_score_adj, selected_tasksize);
+		trace_lowmem_kill(selected, selected_oom_score_adj,
+				  selected_tasksize,
+				  selected_oom_score_adj < static_score_adj);
+		spin_lock_irqsave(&lowmem_bucket_lock, flags);
+		lowmem_deathpending = selected_leader;
 		lowmem_deathpending_timeout = jiffies + HZ;
+		spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
@@ -180,6 +484,13 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(predict, lowmem_predict, uint, S_IRUGO | S_IWUSR);
+module_param_named(predict_horizon_ms, lowmem_predict_horizon_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(predict_max_pct, lowmem_predict_max_pct, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(predict_swap_full_pct, lowmem_predict_swap_full_pct, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,85 @@
+#if !defined(_LOWMEMORYKILLER_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H_
+
+#include <linux/stringify.h>
+#include <linux/types.h>
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+#define TRACE_SYSTEM_STRING __stringify(TRACE_SYSTEM)
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+
+TRACE_EVENT(lowmem_pressure,
+	    TP_PROTO(u32 alloc_rate, u32 efficiency, u32 swap_fill),
+	    TP_ARGS(alloc_rate, efficiency, swap_fill),
+	    TP_STRUCT__entry(
+		    __field(u32, alloc_rate)
+		    __field(u32, efficiency)
+		    __field(u32, swap_fill)
+		    ),
+	    TP_fast_assign(
+		    __entry->alloc_rate = alloc_rate;
+		    __entry->efficiency = efficiency;
+		    __entry->swap_fill = swap_fill;
+		    ),
+	    TP_printk("allocating %u pages/s, reclaim %u%% efficient, swap %u%% full",
+		      __entry->alloc_rate, __entry->efficiency,
+		      __entry->swap_fill)
+);
+
+TRACE_EVENT(lowmem_threshold,
+	    TP_PROTO(int other_free, int other_file, int minfree,
+		     int static_minfree, int min_score_adj),
+	    TP_ARGS(other_free, other_file, minfree, static_minfree,
+		    min_score_adj),
+	    TP_STRUCT__entry(
+		    __field(int, other_free)
+		    __field(int, other_file)
+		    __field(int, minfree)
+		    __field(int, static_minfree)
+		    __field(int, min_score_adj)
+		    ),
+	    TP_fast_assign(
+		    __entry->other_free = other_free;
+		    __entry->other_file = other_file;
+		    __entry->minfree = minfree;
+		    __entry->static_minfree = static_minfree;
+		    __entry->min_score_adj = min_score_adj;
+		    ),
+	    TP_printk("free %d, file %d below minfree %d (static %d), kill adj >= %d",
+		      __entry->other_free, __entry->other_file,
+		      __entry->minfree, __entry->static_minfree,
+		      __entry->min_score_adj)
+);
+
+TRACE_EVENT(lowmem_kill,
+	    TP_PROTO(struct task_struct *p, int oom_score_adj, int tasksize,
+		     bool predicted),
+	    TP_ARGS(p, oom_score_adj, tasksize, predicted),
+	    TP_STRUCT__entry(
+		    __array(char, comm, TASK_COMM_LEN)
+		    __field(pid_t, pid)
+		    __field(int, oom_score_adj)
+		    __field(int, tasksize)
+		    __field(bool, predicted)
+		    ),
+	    TP_fast_assign(
+		    memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		    __entry->pid = p->pid;
+		    __entry->oom_score_adj = oom_score_adj;
+		    __entry->tasksize = tasksize;
+		    __entry->predicted = predicted;
+		    ),
+	    TP_printk("kill %d (%s), adj %d, size %d%s", __entry->pid,
+		      __entry->comm, __entry->oom_score_adj, __entry->tasksize,
+		      __entry->predicted ? ", ahead of static thresholds" : "")
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
@@ -185,14 +185,22 @@ struct dmm {
 enum mem_type {
 	MEMTYPE_PAGES = 0,
 	MEMTYPE_CARVEOUT,
+	MEMTYPE_RUNS,
 };
 
+struct tiler_page_run;
+
 struct mem_info {
 	enum mem_type type;
 	union {
 		struct page **pages;
 		uint32_t *phys_addrs;
+		struct tiler_page_run *runs;
 	};
+	/* for MEMTYPE_RUNS: number of runs, and run containing page run_start */
+	uint32_t num_runs;
+	uint32_t run;
+	uint32_t run_start;
 };
 
 #endif
@@ -189,6 +189,31 @@ static struct dmm_txn *dmm_txn_init(struct dmm *dmm, struct tcm *tcm)
 	return txn;
 }
 
+/**
+ * Physical address of page n of a run list.  dmm_txn_append() walks each
+ * slice in reverse, jumping forward once when the slice is rolled, so keep
+ * a cursor that steps back and forth instead of walking the runs from the
+ * start for every page.
+ */
+static uint32_t mem_run_phys(struct mem_info *mem, uint32_t n)
+{
+	struct tiler_page_run *runs = mem->runs;
+
+	while (n < mem->run_start && mem->run) {
+		mem->run--;
+		mem->run_start -= runs[mem->run].npages;
+	}
+	while (mem->run < mem->num_runs &&
+	       n >= mem->run_start + runs[mem->run].npages) {
+		mem->run_start += runs[mem->run].npages;
+		mem->run++;
+	}
+	if (mem->run >= mem->num_runs)
+		return omap_dmm->dummy_pa;
+
+	return runs[mem->run].phys + ((n - mem->run_start) << PAGE_SHIFT);
+}
+
 /**
  * Add region to DMM transaction.  If pages or pages[i] is NULL, then the
  * corresponding slot is cleared (ie. dummy_pa is programmed)
@@ -233,6 +258,8 @@ static int dmm_txn_append(struct dmm_txn *txn, struct pat_area *area,
 				data[i] = (mem->pages && mem->pages[n]) ?
 					page_to_phys(mem->pages[n]) :
 					engine->dmm->dummy_pa;
+			} else if (mem->type == MEMTYPE_RUNS) {
+				data[i] = mem_run_phys(mem, n);
 			} else {
 				data[i] = mem->phys_addrs ? mem->phys_addrs[n] :
 						engine->dmm->dummy_pa;
@@ -376,6 +403,25 @@ int tiler_pin_phys(struct tiler_block *block, u32 *phys_addrs,
 }
 EXPORT_SYMBOL(tiler_pin_phys);
 
+int tiler_pin_runs(struct tiler_block *block, struct tiler_page_run *runs,
+			u32 num_runs)
+{
+	struct mem_info mem;
+	u32 i, num_pages = 0;
+
+	for (i = 0; i < num_runs; i++)
+		num_pages += runs[i].npages;
+
+	mem.type = MEMTYPE_RUNS;
+	mem.runs = runs;
+	mem.num_runs = num_runs;
+	mem.run = 0;
+	mem.run_start = 0;
+
+	return fill(&block->area, &mem, num_pages, 0, true);
+}
+EXPORT_SYMBOL(tiler_pin_runs);
+
 /*
  * Reserve/release
  */
@@ -101,10 +101,18 @@ S Y X	Description				Alternate description
 int tiler_map_show(struct seq_file *s, void *arg);
 #endif
 
+/* physically contiguous run of pages */
+struct tiler_page_run {
+	u32 phys;
+	u32 npages;
+};
+
 /* pin/unpin */
 int tiler_pin(struct tiler_block *block, struct page **pages,
 		uint32_t npages, uint32_t roll, bool wait);
 int tiler_pin_phys(struct tiler_block *block, u32 *phys_addrs, u32 num_pages);
+int tiler_pin_runs(struct tiler_block *block, struct tiler_page_run *runs,
+		u32 num_runs);
 int tiler_unpin(struct tiler_block *block);
 
 /* reserve/release */
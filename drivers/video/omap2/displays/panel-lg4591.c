@@ -170,20 +170,32 @@ static struct lg4591_reg display_on[] = {
 static int lg4591_write_sequence(struct omap_dss_device *dssdev,
 		struct lg4591_reg *seq, int len)
 {
+	struct lg4591_data *lg_d = dev_get_drvdata(&dssdev->dev);
 	int r, i;
 
+	/*
+	 * The whole sequence is queued back to back and acked with a single
+	 * BTA. DSI waits for the VC FIFO to drain when it fills up, which
+	 * used to need a delay after each write on OMAP5.
+	 */
+	r = dsi_vc_write_batch_begin(dssdev, lg_d->config_channel);
+	if (r)
+		return r;
+
 	for (i = 0; i < len; i++) {
 		r = lg4591_write(dssdev, seq[i].data, seq[i].len);
 		if (r) {
 			dev_err(&dssdev->dev, "sequence failed: %d\n", i);
+			dsi_vc_write_batch_end(dssdev, lg_d->config_channel);
 			return -EINVAL;
 		}
-
-		/* TODO: Figure out why this is needed for OMAP5 */
-		msleep(1);
 	}
 
-	return 0;
+	r = dsi_vc_write_batch_end(dssdev, lg_d->config_channel);
+	if (r)
+		dev_err(&dssdev->dev, "sequence not acked: %d\n", r);
+
+	return r;
 }
 
 /* dummy functions */
@@ -428,7 +428,8 @@ static void taal_queue_ulps_work(struct omap_dss_device *dssdev)
 
 	if (td->ulps_timeout > 0)
 		queue_delayed_work(td->workqueue, &td->ulps_work,
-				msecs_to_jiffies(td->ulps_timeout));
+				msecs_to_jiffies(omap_dsi_get_ulps_timeout(dssdev,
+						td->ulps_timeout)));
 }
 
 static void taal_cancel_ulps_work(struct omap_dss_device *dssdev)
@@ -1387,24 +1388,18 @@ static irqreturn_t taal_te_isr(int irq, void *data)
 {
 	struct omap_dss_device *dssdev = data;
 	struct taal_data *td = dev_get_drvdata(&dssdev->dev);
+	ktime_t te_stamp = ktime_get();
 	int old;
-	int r;
 
 	old = atomic_cmpxchg(&td->do_update, 1, 0);
 
 	if (old) {
 		cancel_delayed_work(&td->te_timeout_work);
 
-		r = omap_dsi_update(dssdev, td->channel, taal_framedone_cb,
-				dssdev);
-		if (r)
-			goto err;
+		/* the update was prepared in taal_update(), only kick it */
+		omap_dsi_start_update(dssdev, te_stamp);
 	}
 
-	return IRQ_HANDLED;
-err:
-	dev_err(&dssdev->dev, "start update failed\n");
-	dsi_bus_unlock(dssdev);
 	return IRQ_HANDLED;
 }
 
@@ -1449,6 +1444,11 @@ static int taal_update(struct omap_dss_device *dssdev,
 		goto err;
 
 	if (td->te_enabled && panel_data->use_ext_te) {
+		r = omap_dsi_prepare_update(dssdev, td->channel,
+				taal_framedone_cb, dssdev);
+		if (r)
+			goto err;
+
 		schedule_delayed_work(&td->te_timeout_work,
 				msecs_to_jiffies(250));
 		atomic_set(&td->do_update, 1);
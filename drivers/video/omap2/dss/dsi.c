@@ -40,6 +40,8 @@
 #include <linux/debugfs.h>
 #include <linux/pm_runtime.h>
 
+#include <asm/unaligned.h>
+
 #include <video/omapdss.h>
 #include <video/mipi_display.h>
 #include <plat/clock.h>
@@ -47,9 +49,15 @@
 #include "dss.h"
 #include "dss_features.h"
 
+#define CREATE_TRACE_POINTS
+#include "dsi_trace.h"
+
 /*#define VERBOSE_IRQ*/
 #define DSI_CATCH_MISSING_TE
 
+/* shortest idle time before ULPS is entered, see omap_dsi_get_ulps_timeout */
+#define DSI_ULPS_MIN_TIMEOUT_MS	20
+
 struct dsi_reg { u16 idx; };
 
 #define DSI_REG(idx)		((const struct dsi_reg) { idx })
@@ -273,8 +281,18 @@ struct dsi_data {
 		struct omap_dss_device *dssdev;
 		enum fifo_size fifo_size;
 		int vc_id;
+		/* bytes written to the TX FIFO since it was last seen empty */
+		unsigned tx_queued;
 	} vc[4];
 
+	/* L4 write batch, see dsi_vc_write_batch_begin() */
+	struct {
+		int channel;
+		unsigned cmds;
+		unsigned bytes;
+		ktime_t start_time;
+	} batch;
+
 	struct mutex lock;
 	struct semaphore bus_lock;
 
@@ -286,9 +304,21 @@ struct dsi_data {
 	struct dsi_isr_tables isr_tables_copy;
 
 	int update_channel;
-#ifdef DEBUG
 	unsigned update_bytes;
-#endif
+
+	/* packet layout of a full frame update, cached per update size */
+	struct {
+		u16 w, h;
+		unsigned te_size;
+		unsigned packet_len;
+	} update_cfg;
+
+	ktime_t update_arm_time;
+	ktime_t update_start_time;
+	ktime_t last_update_time;
+	bool update_waiting_te;
+	/* running average of the time between update starts */
+	u32 update_gap_avg_us;
 
 	bool te_enabled;
 	bool ulps_enabled;
@@ -339,6 +369,7 @@ struct dsi_data {
 struct dsi_packet_sent_handler_data {
 	struct platform_device *dsidev;
 	struct completion *completion;
+	int channel;
 };
 
 static struct platform_device *dsi_pdev_map[MAX_NUM_DSI];
@@ -770,6 +801,15 @@ static irqreturn_t omap_dsi_irq_handler(int irq, void *arg)
 		del_timer(&dsi->te_timer);
 #endif
 
+	/* with TE_EN the transfer is started by the HW at the TE edge */
+	if ((irqstatus & DSI_IRQ_TE_TRIGGER) && dsi->update_waiting_te) {
+		dsi->update_waiting_te = false;
+		dsi->update_start_time = ktime_get();
+		trace_dsi_te(dsi_get_dsidev_id(dsidev), dsi->update_channel,
+				(u32)ktime_us_delta(dsi->update_start_time,
+					dsi->update_arm_time));
+	}
+
 	/* make a copy and unlock, so that isrs can unregister
 	 * themselves */
 	memcpy(&dsi->isr_tables_copy, &dsi->isr_tables,
@@ -2511,6 +2551,10 @@ static int dsi_cio_init(struct omap_dss_device *dssdev)
 			dssdev->panel.dsi_vm_data.ddr_clk_always_on, 13, 13);
 	}
 
+	if (dsi->ulps_enabled)
+		trace_dsi_ulps(dsi_get_dsidev_id(dsidev), false,
+				dsi->update_gap_avg_us);
+
 	dsi->ulps_enabled = false;
 
 	DSSDBG("CIO init done\n");
@@ -2643,7 +2687,8 @@ static int dsi_sync_vc_vp(struct platform_device *dsidev, int channel)
 {
 	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
 	DECLARE_COMPLETION_ONSTACK(completion);
-	struct dsi_packet_sent_handler_data vp_data = { dsidev, &completion };
+	struct dsi_packet_sent_handler_data vp_data = { dsidev, &completion,
+		channel };
 	int r = 0;
 	u8 bit;
 
@@ -2679,8 +2724,7 @@ static void dsi_packet_sent_handler_l4(void *data, u32 mask)
 {
 	struct dsi_packet_sent_handler_data *l4_data =
 		(struct dsi_packet_sent_handler_data *) data;
-	struct dsi_data *dsi = dsi_get_dsidrv_data(l4_data->dsidev);
-	const int channel = dsi->update_channel;
+	const int channel = l4_data->channel;
 
 	if (REG_GET(l4_data->dsidev, DSI_VC_CTRL(channel), 5, 5) == 0)
 		complete(l4_data->completion);
@@ -2688,8 +2732,10 @@ static void dsi_packet_sent_handler_l4(void *data, u32 mask)
 
 static int dsi_sync_vc_l4(struct platform_device *dsidev, int channel)
 {
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
 	DECLARE_COMPLETION_ONSTACK(completion);
-	struct dsi_packet_sent_handler_data l4_data = { dsidev, &completion };
+	struct dsi_packet_sent_handler_data l4_data = { dsidev, &completion,
+		channel };
 	int r = 0;
 
 	r = dsi_register_isr_vc(dsidev, channel, dsi_packet_sent_handler_l4,
@@ -2710,6 +2756,8 @@ static int dsi_sync_vc_l4(struct platform_device *dsidev, int channel)
 	dsi_unregister_isr_vc(dsidev, channel, dsi_packet_sent_handler_l4,
 		&l4_data, DSI_VC_IRQ_PACKET_SENT);
 
+	dsi->vc[channel].tx_queued = 0;
+
 	return 0;
 err1:
 	dsi_unregister_isr_vc(dsidev, channel, dsi_packet_sent_handler_l4,
@@ -2953,6 +3001,7 @@ static int dsi_vc_send_bta(struct platform_device *dsidev, int channel)
 int dsi_vc_send_bta_sync(struct omap_dss_device *dssdev, int channel)
 {
 	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
 	DECLARE_COMPLETION_ONSTACK(completion);
 	int r = 0;
 	u32 err;
@@ -2984,6 +3033,9 @@ int dsi_vc_send_bta_sync(struct omap_dss_device *dssdev, int channel)
 		r = -EIO;
 		goto err2;
 	}
+
+	/* the peripheral can only take the bus once the FIFO has drained */
+	dsi->vc[channel].tx_queued = 0;
 err2:
 	dsi_unregister_isr(dsidev, dsi_completion_handler, &completion,
 			DSI_IRQ_ERROR_MASK);
@@ -2995,6 +3047,35 @@ err0:
 }
 EXPORT_SYMBOL(dsi_vc_send_bta_sync);
 
+/*
+ * Makes room for a packet of 'bytes' bytes (header included) in the TX FIFO
+ * of the given VC. Packets are queued back to back, and we only wait for the
+ * FIFO to drain when the next packet would not fit. This lets a series of
+ * nosync writes go out without a BTA or a fixed delay in between.
+ */
+static int dsi_vc_reserve_fifo(struct platform_device *dsidev, int channel,
+		unsigned bytes)
+{
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+	unsigned fifo_bytes = dsi->vc[channel].fifo_size * 32 * 4;
+	int r;
+
+	if (dsi->vc[channel].tx_queued + bytes > fifo_bytes) {
+		r = dsi_sync_vc_l4(dsidev, channel);
+		if (r)
+			return r;
+	}
+
+	dsi->vc[channel].tx_queued += bytes;
+
+	if (dsi->batch.channel == channel) {
+		dsi->batch.cmds++;
+		dsi->batch.bytes += bytes;
+	}
+
+	return 0;
+}
+
 static inline void dsi_vc_write_long_header(struct platform_device *dsidev,
 		int channel, u8 data_type, u16 len, u8 ecc)
 {
@@ -3033,7 +3114,7 @@ static int dsi_vc_send_long(struct platform_device *dsidev, int channel,
 	int i;
 	u8 *p;
 	int r = 0;
-	u8 b1, b2, b3, b4;
+	u8 b1, b2, b3;
 
 	if (dsi->debug_write)
 		DSSDBG("dsi_vc_send_long, %d bytes\n", len);
@@ -3046,6 +3127,10 @@ static int dsi_vc_send_long(struct platform_device *dsidev, int channel,
 
 	dsi_vc_config_source(dsidev, channel, DSI_VC_SOURCE_L4);
 
+	r = dsi_vc_reserve_fifo(dsidev, channel, 4 + ALIGN(len, 4));
+	if (r)
+		return r;
+
 	dsi_vc_write_long_header(dsidev, channel, data_type, len, ecc);
 
 	p = data;
@@ -3053,12 +3138,10 @@ static int dsi_vc_send_long(struct platform_device *dsidev, int channel,
 		if (dsi->debug_write)
 			DSSDBG("\tsending full packet %d\n", i);
 
-		b1 = *p++;
-		b2 = *p++;
-		b3 = *p++;
-		b4 = *p++;
-
-		dsi_vc_write_long_payload(dsidev, channel, b1, b2, b3, b4);
+		/* the payload is sent LSB first, i.e. in memory order */
+		dsi_write_reg(dsidev, DSI_VC_LONG_PACKET_PAYLOAD(channel),
+				get_unaligned_le32(p));
+		p += 4;
 	}
 
 	i = len % 4;
@@ -3105,6 +3188,9 @@ static int dsi_vc_send_short(struct platform_device *dsidev, int channel,
 
 	dsi_vc_config_source(dsidev, channel, DSI_VC_SOURCE_L4);
 
+	if (dsi_vc_reserve_fifo(dsidev, channel, 4))
+		return -EIO;
+
 	if (FLD_GET(dsi_read_reg(dsidev, DSI_VC_CTRL(channel)), 16, 16)) {
 		DSSERR("ERROR FIFO FULL, aborting transfer\n");
 		return -EINVAL;
@@ -3220,6 +3306,64 @@ int dsi_vc_generic_write(struct omap_dss_device *dssdev, int channel, u8 *data,
 }
 EXPORT_SYMBOL(dsi_vc_generic_write);
 
+/*
+ * A write batch lets a panel driver send a long series of nosync writes, e.g.
+ * its init sequence or a gamma table, with only a single BTA at the end,
+ * instead of one BTA per command as with dsi_vc_dcs_write(). The writes are
+ * done with dsi_vc_dcs_write_nosync() and dsi_vc_generic_write_nosync()
+ * between dsi_vc_write_batch_begin() and dsi_vc_write_batch_end().
+ */
+int dsi_vc_write_batch_begin(struct omap_dss_device *dssdev, int channel)
+{
+	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+
+	WARN_ON(!dsi_bus_is_locked(dsidev));
+
+	if (dsi->batch.channel != -1) {
+		DSSERR("write batch already active on channel %d\n",
+				dsi->batch.channel);
+		return -EBUSY;
+	}
+
+	dsi->batch.channel = channel;
+	dsi->batch.cmds = 0;
+	dsi->batch.bytes = 0;
+	dsi->batch.start_time = ktime_get();
+
+	return 0;
+}
+EXPORT_SYMBOL(dsi_vc_write_batch_begin);
+
+int dsi_vc_write_batch_end(struct omap_dss_device *dssdev, int channel)
+{
+	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+	int r;
+
+	if (WARN_ON(dsi->batch.channel != channel))
+		return -EINVAL;
+
+	r = dsi_vc_send_bta_sync(dssdev, channel);
+
+	/* RX_FIFO_NOT_EMPTY */
+	if (!r && REG_GET(dsidev, DSI_VC_CTRL(channel), 20, 20)) {
+		DSSERR("rx fifo not empty after write batch, dumping data:\n");
+		dsi_vc_flush_receive_data(dsidev, channel);
+		r = -EIO;
+	}
+
+	trace_dsi_write_batch(dsi_get_dsidev_id(dsidev), channel,
+			dsi->batch.cmds, dsi->batch.bytes,
+			(u32)ktime_us_delta(ktime_get(), dsi->batch.start_time),
+			r);
+
+	dsi->batch.channel = -1;
+
+	return r;
+}
+EXPORT_SYMBOL(dsi_vc_write_batch_end);
+
 int dsi_vc_dcs_write_0(struct omap_dss_device *dssdev, int channel, u8 dcs_cmd)
 {
 	return dsi_vc_dcs_write(dssdev, channel, &dcs_cmd, 1);
@@ -3629,6 +3773,8 @@ static int dsi_enter_ulps(struct platform_device *dsidev)
 
 	dsi->ulps_enabled = true;
 
+	trace_dsi_ulps(dsi_get_dsidev_id(dsidev), true, dsi->update_gap_avg_us);
+
 	return 0;
 
 err:
@@ -4287,7 +4433,7 @@ void dsi_disable_video_output(struct omap_dss_device *dssdev, int channel)
 }
 EXPORT_SYMBOL(dsi_disable_video_output);
 
-static void dsi_update_screen_dispc(struct omap_dss_device *dssdev,
+static void dsi_update_calc_cfg(struct omap_dss_device *dssdev,
 		u16 w, u16 h)
 {
 	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
@@ -4298,15 +4444,8 @@ static void dsi_update_screen_dispc(struct omap_dss_device *dssdev,
 	unsigned total_len;
 	unsigned packet_payload;
 	unsigned packet_len;
-	u32 l;
-	int r;
-	const unsigned channel = dsi->update_channel;
 	const unsigned line_buf_size = dsi_get_line_buf_size(dsidev);
 
-	DSSDBG("dsi_update_screen_dispc(%dx%d)\n", w, h);
-
-	dsi_vc_config_source(dsidev, channel, DSI_VC_SOURCE_VP);
-
 	bytespp	= dsi_get_pixel_size(dssdev->panel.dsi_pix_fmt) / 8;
 	bytespl = w * bytespp;
 	bytespf = bytespl * h;
@@ -4325,11 +4464,59 @@ static void dsi_update_screen_dispc(struct omap_dss_device *dssdev,
 	if (bytespf % packet_payload)
 		total_len += (bytespf % packet_payload) + 1;
 
-	l = FLD_VAL(total_len, 23, 0); /* TE_SIZE */
-	dsi_write_reg(dsidev, DSI_VC_TE(channel), l);
+	dsi->update_cfg.w = w;
+	dsi->update_cfg.h = h;
+	dsi->update_cfg.te_size = total_len;
+	dsi->update_cfg.packet_len = packet_len;
+	dsi->update_bytes = bytespf;
+}
+
+/*
+ * First half of a command mode update: everything that can be done before
+ * the TE edge. The packet layout is only recalculated when the update size
+ * changes, so for a steady stream of updates this boils down to a single
+ * register write.
+ */
+static int dsi_update_prepare_dispc(struct omap_dss_device *dssdev,
+		u16 w, u16 h)
+{
+	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+	const unsigned channel = dsi->update_channel;
+	int r;
+
+	DSSDBG("dsi_update_prepare_dispc(%dx%d)\n", w, h);
+
+	r = dsi_vc_config_source(dsidev, channel, DSI_VC_SOURCE_VP);
+	if (r)
+		return r;
+
+	if (dsi->update_cfg.w != w || dsi->update_cfg.h != h)
+		dsi_update_calc_cfg(dssdev, w, h);
+
+	dsi_write_reg(dsidev, DSI_VC_TE(channel),
+			FLD_VAL(dsi->update_cfg.te_size, 23, 0)); /* TE_SIZE */
+
+	return 0;
+}
+
+/* Second half of a command mode update, to be called at the TE edge */
+static void dsi_update_start_dispc(struct omap_dss_device *dssdev,
+		ktime_t te_stamp)
+{
+	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+	u32 l;
+	u32 gap_us = 0;
+	u32 te_latency_us = 0;
+	int r;
+	const unsigned channel = dsi->update_channel;
+	ktime_t now;
+
+	l = FLD_VAL(dsi->update_cfg.te_size, 23, 0); /* TE_SIZE */
 
 	dsi_vc_write_long_header(dsidev, channel, MIPI_DSI_DCS_LONG_WRITE,
-		packet_len, 0);
+		dsi->update_cfg.packet_len, 0);
 
 	if (dsi->te_enabled)
 		l = FLD_MOD(l, 1, 30, 30); /* TE_EN */
@@ -4347,6 +4534,28 @@ static void dsi_update_screen_dispc(struct omap_dss_device *dssdev,
 
 	dsi_perf_mark_start(dsidev);
 
+	now = ktime_get();
+
+	if (ktime_to_ns(dsi->last_update_time) != 0) {
+		/* cap the sample so that a long idle period doesn't swamp
+		 * the average */
+		gap_us = (u32)min_t(s64, ktime_us_delta(now,
+					dsi->last_update_time), USEC_PER_SEC);
+		dsi->update_gap_avg_us = dsi->update_gap_avg_us ?
+			(dsi->update_gap_avg_us * 7 + gap_us) / 8 : gap_us;
+	}
+	dsi->last_update_time = now;
+
+	if (ktime_to_ns(te_stamp) != 0)
+		te_latency_us = (u32)ktime_us_delta(now, te_stamp);
+
+	trace_dsi_update_start(dsi_get_dsidev_id(dsidev), channel,
+			te_latency_us, gap_us);
+
+	dsi->update_arm_time = now;
+	dsi->update_start_time = now;
+	dsi->update_waiting_te = dsi->te_enabled;
+
 	r = schedule_delayed_work(&dsi->framedone_timeout_work,
 		msecs_to_jiffies(250));
 	BUG_ON(r == 0);
@@ -4387,6 +4596,13 @@ static void dsi_handle_framedone(struct platform_device *dsidev, int error)
 		REG_FLD_MOD(dsidev, DSI_TIMING2, 1, 15, 15); /* LP_RX_TO */
 	}
 
+	dsi->update_waiting_te = false;
+
+	trace_dsi_update_done(dsi_get_dsidev_id(dsidev), dsi->update_channel,
+			error, (u32)ktime_us_delta(ktime_get(),
+				dsi->update_start_time),
+			dsi->update_bytes);
+
 	dsi->framedone_callback(error, dsi->framedone_data);
 
 	if (!error)
@@ -4429,7 +4645,7 @@ static void dsi_framedone_irq_callback(void *data, u32 mask)
 #endif
 }
 
-int omap_dsi_update(struct omap_dss_device *dssdev, int channel,
+int omap_dsi_prepare_update(struct omap_dss_device *dssdev, int channel,
 		void (*callback)(int, void *), void *data)
 {
 	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
@@ -4445,16 +4661,60 @@ int omap_dsi_update(struct omap_dss_device *dssdev, int channel,
 
 	dssdev->driver->get_resolution(dssdev, &dw, &dh);
 
-#ifdef DEBUG
-	dsi->update_bytes = dw * dh *
-		dsi_get_pixel_size(dssdev->panel.dsi_pix_fmt) / 8;
-#endif
-	dsi_update_screen_dispc(dssdev, dw, dh);
+	return dsi_update_prepare_dispc(dssdev, dw, dh);
+}
+EXPORT_SYMBOL(omap_dsi_prepare_update);
+
+/*
+ * Kicks off an update set up with omap_dsi_prepare_update(). te_stamp is the
+ * time the panel saw the TE edge, or zero if the update isn't TE driven.
+ */
+void omap_dsi_start_update(struct omap_dss_device *dssdev, ktime_t te_stamp)
+{
+	dsi_update_start_dispc(dssdev, te_stamp);
+}
+EXPORT_SYMBOL(omap_dsi_start_update);
+
+int omap_dsi_update(struct omap_dss_device *dssdev, int channel,
+		void (*callback)(int, void *), void *data)
+{
+	int r;
+
+	r = omap_dsi_prepare_update(dssdev, channel, callback, data);
+	if (r)
+		return r;
+
+	omap_dsi_start_update(dssdev, ktime_set(0, 0));
 
 	return 0;
 }
 EXPORT_SYMBOL(omap_dsi_update);
 
+/*
+ * Returns how long the panel should stay idle before entering ULPS, based on
+ * the measured gap between updates. While updates keep coming at a steady
+ * rate there is no point in entering ULPS in between, but once they stop, or
+ * when they only come in every now and then, waiting for the full max_ms
+ * just burns power.
+ */
+unsigned omap_dsi_get_ulps_timeout(struct omap_dss_device *dssdev,
+		unsigned max_ms)
+{
+	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
+	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
+	unsigned avg_ms = dsi->update_gap_avg_us / 1000;
+	unsigned min_ms = min_t(unsigned, DSI_ULPS_MIN_TIMEOUT_MS, max_ms);
+
+	if (avg_ms == 0)
+		return max_ms;
+
+	if (avg_ms >= max_ms)
+		return min_ms;
+
+	return clamp_t(unsigned, avg_ms * 2, min_ms, max_ms);
+}
+EXPORT_SYMBOL(omap_dsi_get_ulps_timeout);
+
 /* Display funcs */
 
 static int dsi_display_init_dispc(struct omap_dss_device *dssdev)
@@ -4670,7 +4930,7 @@ int omapdss_dsi_display_enable(struct omap_dss_device *dssdev)
 {
 	struct platform_device *dsidev = dsi_get_dsidev_from_dssdev(dssdev);
 	struct dsi_data *dsi = dsi_get_dsidrv_data(dsidev);
-	int r = 0;
+	int r = 0, i;
 
 	DSSDBG("dsi_display_enable\n");
 
@@ -4678,6 +4938,12 @@ int omapdss_dsi_display_enable(struct omap_dss_device *dssdev)
 
 	mutex_lock(&dsi->lock);
 
+	/* the panel may have been reconfigured while we were off */
+	dsi->update_cfg.w = dsi->update_cfg.h = 0;
+
+	for (i = 0; i < ARRAY_SIZE(dsi->vc); i++)
+		dsi->vc[i].tx_queued = 0;
+
 	if (dssdev->manager == NULL) {
 		DSSERR("failed to enable display: no manager\n");
 		r = -ENODEV;
@@ -4954,6 +5220,8 @@ static int omap_dsihw_probe(struct platform_device *dsidev)
 	mutex_init(&dsi->lock);
 	sema_init(&dsi->bus_lock, 1);
 
+	dsi->batch.channel = -1;
+
 	INIT_DELAYED_WORK_DEFERRABLE(&dsi->framedone_timeout_work,
 			dsi_framedone_timeout_work_callback);
 
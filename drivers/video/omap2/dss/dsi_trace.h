@@ -0,0 +1,121 @@
+#if !defined(_DSI_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _DSI_TRACE_H_
+
+#include <linux/stringify.h>
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM omapdss_dsi
+#define TRACE_SYSTEM_STRING __stringify(TRACE_SYSTEM)
+#define TRACE_INCLUDE_FILE dsi_trace
+
+TRACE_EVENT(dsi_te,
+	    TP_PROTO(int module, int channel, u32 wait_us),
+	    TP_ARGS(module, channel, wait_us),
+	    TP_STRUCT__entry(
+		    __field(int, module)
+		    __field(int, channel)
+		    __field(u32, wait_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->module = module;
+		    __entry->channel = channel;
+		    __entry->wait_us = wait_us;
+		    ),
+	    TP_printk("dsi%d vc=%d, waited %u us for TE", __entry->module + 1,
+		      __entry->channel, __entry->wait_us)
+);
+
+TRACE_EVENT(dsi_update_start,
+	    TP_PROTO(int module, int channel, u32 te_latency_us, u32 gap_us),
+	    TP_ARGS(module, channel, te_latency_us, gap_us),
+	    TP_STRUCT__entry(
+		    __field(int, module)
+		    __field(int, channel)
+		    __field(u32, te_latency_us)
+		    __field(u32, gap_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->module = module;
+		    __entry->channel = channel;
+		    __entry->te_latency_us = te_latency_us;
+		    __entry->gap_us = gap_us;
+		    ),
+	    TP_printk("dsi%d vc=%d, TE to start %u us, %u us since last update",
+		      __entry->module + 1, __entry->channel,
+		      __entry->te_latency_us, __entry->gap_us)
+);
+
+TRACE_EVENT(dsi_update_done,
+	    TP_PROTO(int module, int channel, int error, u32 transfer_us,
+		     u32 bytes),
+	    TP_ARGS(module, channel, error, transfer_us, bytes),
+	    TP_STRUCT__entry(
+		    __field(int, module)
+		    __field(int, channel)
+		    __field(int, error)
+		    __field(u32, transfer_us)
+		    __field(u32, bytes)
+		    ),
+	    TP_fast_assign(
+		    __entry->module = module;
+		    __entry->channel = channel;
+		    __entry->error = error;
+		    __entry->transfer_us = transfer_us;
+		    __entry->bytes = bytes;
+		    ),
+	    TP_printk("dsi%d vc=%d, err=%d, %u bytes in %u us",
+		      __entry->module + 1, __entry->channel, __entry->error,
+		      __entry->bytes, __entry->transfer_us)
+);
+
+TRACE_EVENT(dsi_ulps,
+	    TP_PROTO(int module, bool enter, u32 avg_gap_us),
+	    TP_ARGS(module, enter, avg_gap_us),
+	    TP_STRUCT__entry(
+		    __field(int, module)
+		    __field(bool, enter)
+		    __field(u32, avg_gap_us)
+		    ),
+	    TP_fast_assign(
+		    __entry->module = module;
+		    __entry->enter = enter;
+		    __entry->avg_gap_us = avg_gap_us;
+		    ),
+	    TP_printk("dsi%d %s ULPS, average update gap %u us",
+		      __entry->module + 1, __entry->enter ? "enter" : "exit",
+		      __entry->avg_gap_us)
+);
+
+TRACE_EVENT(dsi_write_batch,
+	    TP_PROTO(int module, int channel, u32 cmds, u32 bytes, u32 time_us,
+		     int error),
+	    TP_ARGS(module, channel, cmds, bytes, time_us, error),
+	    TP_STRUCT__entry(
+		    __field(int, module)
+		    __field(int, channel)
+		    __field(u32, cmds)
+		    __field(u32, bytes)
+		    __field(u32, time_us)
+		    __field(int, error)
+		    ),
+	    TP_fast_assign(
+		    __entry->module = module;
+		    __entry->channel = channel;
+		    __entry->cmds = cmds;
+		    __entry->bytes = bytes;
+		    __entry->time_us = time_us;
+		    __entry->error = error;
+		    ),
+	    TP_printk("dsi%d vc=%d, %u packets, %u bytes in %u us, err=%d",
+		      __entry->module + 1, __entry->channel, __entry->cmds,
+		      __entry->bytes, __entry->time_us, __entry->error)
+);
+
+#endif /* _DSI_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
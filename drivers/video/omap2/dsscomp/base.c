@@ -176,14 +176,107 @@ static int crop_to_rect(union rect *crop, union rect *win, union rect *vis,
 	return 0;
 }
 
+/*
+ * HWC resubmits the same layer stack every frame with only the buffer
+ * addresses changing.  We remember the overlay info computed for the last
+ * configuration of each overlay, and if the configuration did not change,
+ * only rebase the buffer addresses instead of redoing the cropping and tiler
+ * view calculations.
+ */
+static struct ovl_cache_entry {
+	bool valid;
+	struct dss2_ovl_cfg cfg;
+	struct omap_overlay_manager *mgr;
+	u16 x_res, y_res;
+	u32 ba_key, uv_key;	/* see ovl_cache_buf_key() */
+	u32 ba_offs, uv_offs;	/* crop offsets from the buffer addresses */
+	struct omap_overlay_info info;
+} ovl_cache[MAX_OVERLAYS];
+static DEFINE_MUTEX(ovl_cache_mtx);
+static u32 ovl_cache_hits, ovl_cache_misses;
+
+/*
+ * The offset of the cropped address from the buffer address only depends on
+ * the configuration, except for TILER 2D buffers where it also depends on the
+ * stride of the view, i.e. on the format and orientation of the container.
+ */
+static u32 ovl_cache_buf_key(u32 addr)
+{
+	enum tiler_fmt fmt;
+
+	if (tiler_get_fmt(addr, &fmt) && fmt >= TILFMT_8BIT &&
+			fmt <= TILFMT_32BIT)
+		return (fmt + 1) << 24 | tiler_stride(addr);
+	return 0;
+}
+
+static bool ovl_cache_lookup(struct dss2_ovl_info *oi,
+		struct omap_overlay *ovl, struct omap_overlay_info *info)
+{
+	struct ovl_cache_entry *e;
+	bool hit;
+
+	if (oi->cfg.ix >= ARRAY_SIZE(ovl_cache) || !ovl->manager ||
+	    !ovl->manager->device)
+		return false;
+	e = ovl_cache + oi->cfg.ix;
+
+	mutex_lock(&ovl_cache_mtx);
+	hit = e->valid && e->mgr == ovl->manager &&
+		e->x_res == ovl->manager->device->panel.timings.x_res &&
+		e->y_res == ovl->manager->device->panel.timings.y_res &&
+		e->ba_key == ovl_cache_buf_key(oi->ba) &&
+		e->uv_key == ovl_cache_buf_key(oi->uv) &&
+		!memcmp(&e->cfg, &oi->cfg, sizeof(e->cfg));
+	if (hit) {
+		*info = e->info;
+		info->paddr = oi->ba + e->ba_offs;
+		info->p_uv_addr = info->color_mode == OMAP_DSS_COLOR_NV12 ?
+			oi->uv + e->uv_offs : 0;
+		ovl_cache_hits++;
+	} else {
+		ovl_cache_misses++;
+	}
+	mutex_unlock(&ovl_cache_mtx);
+
+	return hit;
+}
+
+static void ovl_cache_store(struct dss2_ovl_info *oi,
+		struct omap_overlay *ovl, struct omap_overlay_info *info,
+		bool valid)
+{
+	struct ovl_cache_entry *e;
+
+	if (oi->cfg.ix >= ARRAY_SIZE(ovl_cache))
+		return;
+	e = ovl_cache + oi->cfg.ix;
+
+	mutex_lock(&ovl_cache_mtx);
+	e->valid = valid;
+	if (valid) {
+		e->cfg = oi->cfg;
+		e->mgr = ovl->manager;
+		e->x_res = ovl->manager->device->panel.timings.x_res;
+		e->y_res = ovl->manager->device->panel.timings.y_res;
+		e->ba_key = ovl_cache_buf_key(oi->ba);
+		e->uv_key = ovl_cache_buf_key(oi->uv);
+		e->ba_offs = info->paddr - oi->ba;
+		e->uv_offs = info->p_uv_addr - oi->uv;
+		e->info = *info;
+	}
+	mutex_unlock(&ovl_cache_mtx);
+}
+
 int set_dss_ovl_info(struct dss2_ovl_info *oi)
 {
 	struct omap_overlay_info info;
 	struct omap_overlay *ovl;
 	struct dss2_ovl_cfg *cfg;
 	union rect crop, win, vis;
-	int c;
+	int c, r;
 	enum tiler_fmt fmt;
+	bool cacheable = false;
 
 	/* check overlay number */
 	if (!oi || oi->cfg.ix >= omap_dss_get_num_overlays())
@@ -191,6 +284,10 @@ int set_dss_ovl_info(struct dss2_ovl_info *oi)
 	cfg = &oi->cfg;
 	ovl = omap_dss_get_overlay(cfg->ix);
 
+	if (cfg->enabled && !cfg->zonly &&
+	    ovl_cache_lookup(oi, ovl, &info))
+		return ovl->set_overlay_info(ovl, &info);
+
 	/* just in case there are new fields, we get the current info */
 	ovl->get_overlay_info(ovl, &info);
 
@@ -305,8 +402,10 @@ int set_dss_ovl_info(struct dss2_ovl_info *oi)
 				(crop.y >> 1) * cfg->stride;
 
 		/* no rotation on DMA buffer */
-		if (cfg->rotation & 3 || cfg->mirror)
+		if (cfg->rotation & 3 || cfg->mirror) {
+			ovl_cache_store(oi, ovl, &info, false);
 			return -EINVAL;
+		}
 
 		info.rotation_type = OMAP_DSS_ROT_DMA;
 	}
@@ -337,6 +436,7 @@ int set_dss_ovl_info(struct dss2_ovl_info *oi)
 #endif
 
 	info.cconv = cfg->cconv;
+	cacheable = true;
 
 done:
 	pr_debug("ovl%d: en=%d %x/%x ",	ovl->id, ovl->is_enabled(ovl),
@@ -348,7 +448,37 @@ done:
 			info.zorder);
 	pr_debug("al=%02x prem=%d\n", info.global_alpha, info.pre_mult_alpha);
 	/* set overlay info */
-	return ovl->set_overlay_info(ovl, &info);
+	r = ovl->set_overlay_info(ovl, &info);
+
+	/* don't cache disabled or rejected configurations */
+	if (cfg->enabled && !cfg->zonly)
+		ovl_cache_store(oi, ovl, &info, cacheable && !r);
+
+	return r;
+}
+
+void dsscomp_dbg_ovl_cache(struct seq_file *s)
+{
+#ifdef CONFIG_DEBUG_FS
+	int i;
+
+	mutex_lock(&ovl_cache_mtx);
+	seq_printf(s, "OVERLAY INFO CACHE\n\n  hits=%u misses=%u\n\n",
+			ovl_cache_hits, ovl_cache_misses);
+	for (i = 0; i < ARRAY_SIZE(ovl_cache); i++) {
+		struct ovl_cache_entry *e = ovl_cache + i;
+		if (!e->valid)
+			continue;
+		seq_printf(s, "  ovl%d: %s %dx%d => (%d,%d) %dx%d "
+				"ba+%x uv+%x\n", i, e->mgr->name,
+				e->info.width, e->info.height,
+				e->info.pos_x, e->info.pos_y,
+				e->info.out_width, e->info.out_height,
+				e->ba_offs, e->uv_offs);
+	}
+	seq_printf(s, "\n");
+	mutex_unlock(&ovl_cache_mtx);
+#endif
 }
 
 void swap_rb_in_ovl_info(struct dss2_ovl_info *oi)
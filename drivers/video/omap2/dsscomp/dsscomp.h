@@ -168,6 +168,7 @@ const char *dsscomp_get_color_name(enum omap_color_mode m);
 
 void dsscomp_dbg_comps(struct seq_file *s);
 void dsscomp_dbg_gralloc(struct seq_file *s);
+void dsscomp_dbg_ovl_cache(struct seq_file *s);
 
 #define log_state_str(s) (\
 	(s) == DSSCOMP_STATE_ACTIVE		? "ACTIVE"	: \
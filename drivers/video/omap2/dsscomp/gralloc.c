@@ -23,6 +23,7 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "../../../drivers/staging/omapdrm/omap_dmm_tiler.h"
 #include <video/dsscomp.h>
 #include <plat/dsscomp.h>
@@ -34,21 +35,48 @@
 #endif
 static bool blanked;
 
+/*
+ * The TILER 1D slot pool starts with NUM_TILER1D_SLOTS slots, grows on
+ * demand up to MAX_TILER1D_SLOTS, and gives back the extra slots once no
+ * slot was needed for TILER1D_SLOT_SHRINK_DELAY.
+ */
 #define NUM_TILER1D_SLOTS 2
+#define MAX_TILER1D_SLOTS 4
+#define TILER1D_SLOT_SHRINK_DELAY (2 * HZ)
 
-static struct tiler1d_slot {
+struct tiler1d_slot {
 	struct list_head q;
 	struct tiler_block *block_handle;
 	u32 phys;
 	u32 size;
 	u32 *page_map;
-} slots[NUM_TILER1D_SLOTS];
-static struct list_head free_slots;
+	u32 pinned;		/* pages of page_map pinned into the slot */
+};
+/* free slots in least recently used order */
+static LIST_HEAD(free_slots);
+static u32 num_slots;
+static unsigned long slot_grow_time;
 static struct dsscomp_dev *cdev;
 static DEFINE_MUTEX(mtx);
 static struct semaphore free_slots_sem =
 				__SEMAPHORE_INITIALIZER(free_slots_sem, 0);
 
+/* slot pool statistics, protected by mtx */
+static struct {
+	u32 peak;
+	u32 grows;
+	u32 shrinks;
+	u32 waits;
+	u32 timeouts;
+	u32 pins;
+	u32 pins_skipped;
+	u64 pages_pinned;
+	u64 pages_reused;
+} slot_stats;
+
+static void dsscomp_gralloc_shrink_slots(struct work_struct *work);
+static DECLARE_DELAYED_WORK(shrink_work, dsscomp_gralloc_shrink_slots);
+
 /* gralloc composition sync object */
 struct dsscomp_gralloc_t {
 	void (*cb_fn)(void *, int);
@@ -63,20 +91,209 @@ struct dsscomp_gralloc_t {
 /* queued gralloc compositions */
 static LIST_HEAD(flip_queue);
 
+/* overlays used on each manager, protected by mtx */
 static u32 ovl_use_mask[MAX_MANAGERS];
 
-static void unpin_tiler_blocks(struct list_head *slots)
+/*
+ * Serializes compositions queued to a manager.  A composition locks the
+ * managers it sets and the active managers it leaves out, as it blanks
+ * those, so only idle managers are left to run in parallel with it.
+ */
+static struct mutex mgr_mtx[MAX_MANAGERS];
+
+/* managers using any overlay - mtx must be held */
+static u32 dsscomp_gralloc_active_mgrs(void)
 {
-	struct tiler1d_slot *slot;
+	u32 ch, mask = 0;
+
+	for (ch = 0; ch < MAX_MANAGERS; ch++)
+		if (ovl_use_mask[ch])
+			mask |= 1 << ch;
+	return mask;
+}
+
+/*
+ * Lock the managers in mgr_mask and the active ones.  Managers are always
+ * locked in ascending order.  Returns the mask of the locked managers.
+ */
+static u32 dsscomp_gralloc_lock_mgrs(u32 mgr_mask)
+{
+	u32 ch, lock_mask, active;
+
+	mutex_lock(&mtx);
+	active = dsscomp_gralloc_active_mgrs();
+	mutex_unlock(&mtx);
+
+	for (;;) {
+		lock_mask = mgr_mask | active;
+		for (ch = 0; ch < MAX_MANAGERS; ch++)
+			if (lock_mask & (1 << ch))
+				mutex_lock(&mgr_mtx[ch]);
+
+		/* a manager may have become active while we were waiting */
+		mutex_lock(&mtx);
+		active = dsscomp_gralloc_active_mgrs();
+		mutex_unlock(&mtx);
+		if (!(active & ~lock_mask))
+			return lock_mask;
+
+		for (ch = MAX_MANAGERS; ch-- > 0; )
+			if (lock_mask & (1 << ch))
+				mutex_unlock(&mgr_mtx[ch]);
+	}
+}
+
+static void dsscomp_gralloc_unlock_mgrs(u32 lock_mask)
+{
+	u32 ch;
+
+	for (ch = MAX_MANAGERS; ch-- > 0; )
+		if (lock_mask & (1 << ch))
+			mutex_unlock(&mgr_mtx[ch]);
+}
+
+static struct tiler1d_slot *alloc_tiler_slot(void)
+{
+	struct tiler1d_slot *slot = kzalloc(sizeof(*slot), GFP_KERNEL);
+
+	if (!slot)
+		return NULL;
 
-	/* unpin any tiler memory */
-	list_for_each_entry(slot, slots, q) {
+	slot->block_handle = tiler_reserve_1d(tiler1d_slot_size(cdev));
+	if (IS_ERR_OR_NULL(slot->block_handle)) {
+		pr_err("could not allocate tiler block\n");
+		goto fail;
+	}
+	slot->phys = tiler_ssptr(slot->block_handle);
+	slot->size = tiler1d_slot_size(cdev) >> PAGE_SHIFT;
+	slot->page_map = vmalloc(sizeof(*slot->page_map) * slot->size);
+	if (!slot->page_map) {
+		pr_err("could not allocate page_map\n");
+		tiler_release(slot->block_handle);
+		goto fail;
+	}
+	return slot;
+fail:
+	kfree(slot);
+	return NULL;
+}
+
+static void free_tiler_slot(struct tiler1d_slot *slot)
+{
+	if (slot->pinned)
 		tiler_unpin(slot->block_handle);
+	tiler_release(slot->block_handle);
+	vfree(slot->page_map);
+	kfree(slot);
+}
+
+/*
+ * Get a free tiler slot for a frame, growing the pool if needed.  Prefer a
+ * slot that still has first_page pinned, as resubmitting the same buffer
+ * can then skip repinning it.
+ */
+static struct tiler1d_slot *get_tiler_slot(struct dsscomp_gralloc_t *gsync,
+					   u32 first_page)
+{
+	struct tiler1d_slot *slot = NULL, *s;
+	bool grow = false;
+
+	if (down_trylock(&free_slots_sem)) {
+		mutex_lock(&mtx);
+		if (num_slots < MAX_TILER1D_SLOTS) {
+			num_slots++;
+			grow = true;
+		} else {
+			slot_stats.waits++;
+		}
+		mutex_unlock(&mtx);
+
+		if (grow)
+			slot = alloc_tiler_slot();
+
+		mutex_lock(&mtx);
+		if (slot) {
+			slot_grow_time = jiffies;
+			slot_stats.grows++;
+			slot_stats.peak = max(slot_stats.peak, num_slots);
+			list_add(&slot->q, &gsync->slots);
+		} else if (grow) {
+			num_slots--;
+			slot_stats.waits++;
+		}
+		mutex_unlock(&mtx);
+		if (slot)
+			return slot;
+
+		if (down_timeout(&free_slots_sem, msecs_to_jiffies(100))) {
+			mutex_lock(&mtx);
+			slot_stats.timeouts++;
+			mutex_unlock(&mtx);
+			return NULL;
+		}
+	}
+
+	mutex_lock(&mtx);
+	list_for_each_entry(s, &free_slots, q) {
+		if (s->pinned && s->page_map[0] == first_page) {
+			slot = s;
+			break;
+		}
+	}
+	if (!slot)
+		slot = list_first_entry(&free_slots, typeof(*slot), q);
+	list_move(&slot->q, &gsync->slots);
+	mutex_unlock(&mtx);
+	return slot;
+}
+
+/*
+ * Return tiler slots to the pool - mtx must be held.  Slots stay pinned
+ * until they are reused or freed; nothing scans out of a free slot.
+ */
+static void release_tiler_slots(struct list_head *slots)
+{
+	struct tiler1d_slot *slot;
+
+	list_for_each_entry(slot, slots, q)
 		up(&free_slots_sem);
+
+	list_splice_tail_init(slots, &free_slots);
+
+	if (num_slots > NUM_TILER1D_SLOTS)
+		schedule_delayed_work(&shrink_work, TILER1D_SLOT_SHRINK_DELAY);
+}
+
+/* free one extra slot at a time once the pool has not grown for a while */
+static void dsscomp_gralloc_shrink_slots(struct work_struct *work)
+{
+	struct tiler1d_slot *slot = NULL;
+
+	mutex_lock(&mtx);
+	if (num_slots <= NUM_TILER1D_SLOTS)
+		goto done;
+
+	if (time_before(jiffies, slot_grow_time + TILER1D_SLOT_SHRINK_DELAY)) {
+		schedule_delayed_work(&shrink_work, slot_grow_time +
+				      TILER1D_SLOT_SHRINK_DELAY - jiffies);
+		goto done;
 	}
 
-	/* free tiler slots */
-	list_splice_init(slots, &free_slots);
+	/* slots in use will reschedule us when they are released */
+	if (down_trylock(&free_slots_sem))
+		goto done;
+
+	slot = list_first_entry(&free_slots, typeof(*slot), q);
+	list_del(&slot->q);
+	num_slots--;
+	slot_stats.shrinks++;
+	if (num_slots > NUM_TILER1D_SLOTS)
+		schedule_delayed_work(&shrink_work, TILER1D_SLOT_SHRINK_DELAY);
+done:
+	mutex_unlock(&mtx);
+
+	if (slot)
+		free_tiler_slot(slot);
 }
 
 static void dsscomp_gralloc_cb(void *data, int status)
@@ -91,7 +308,7 @@ static void dsscomp_gralloc_cb(void *data, int status)
 
 	if (status & DSS_COMPLETION_RELEASED) {
 		if (atomic_dec_and_test(&gsync->refs))
-			unpin_tiler_blocks(&gsync->slots);
+			release_tiler_slots(&gsync->slots);
 
 		log_event(0, 0, gsync, "--refs=%d on %s",
 				atomic_read(&gsync->refs),
@@ -191,16 +408,18 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 	int r = 0;
 	struct omap_dss_device *dev;
 	struct omap_overlay_manager *mgr;
-	static DEFINE_MUTEX(local_mtx);
 	struct dsscomp *comp[MAX_MANAGERS];
 	u32 ovl_new_use_mask[MAX_MANAGERS];
 	u32 mgr_set_mask = 0;
 	u32 ovl_set_mask = 0;
+	u32 lock_mask = 0;
 	struct tiler1d_slot *slot = NULL;
 	u32 slot_used = 0;
+	bool slot_dirty = false;
 #ifdef CONFIG_DEBUG_FS
 	u32 ms = ktime_to_ms(ktime_get());
 #endif
+	ktime_t start = ktime_get();
 	u32 channels[ARRAY_SIZE(d->mgrs)], ch;
 	int skip;
 	struct dsscomp_gralloc_t *gsync;
@@ -213,10 +432,6 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 	for (i = 0; i < d->num_ovls; i++)
 		dump_ovl_info(cdev, d->ovls + i);
 
-	mutex_lock(&local_mtx);
-
-	mutex_lock(&mtx);
-
 	/* create sync object with 1 temporary ref */
 	gsync = kzalloc(sizeof(*gsync), GFP_KERNEL);
 	gsync->cb_arg = cb_arg;
@@ -224,23 +439,6 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 	gsync->refs.counter = 1;
 	gsync->early_callback = early_callback;
 	INIT_LIST_HEAD(&gsync->slots);
-	list_add_tail(&gsync->q, &flip_queue);
-	if (debug & DEBUG_GRALLOC_PHASES)
-		dev_info(DEV(cdev), "[%p] queuing flip\n", gsync);
-
-	log_event(0, ms, gsync, "new in %pf (refs=1)",
-			(u32)dsscomp_gralloc_queue, 0);
-
-	/* ignore frames while we are blanked */
-	skip = blanked;
-	if (skip && (debug & DEBUG_PHASES))
-		dev_info(DEV(cdev), "[%p,%08x] ignored\n", gsync, d->sync_id);
-
-	/* mark blank frame by NULL tiler pa pointer */
-	if (!skip && pas == NULL)
-		blanked = true;
-
-	mutex_unlock(&mtx);
 
 	d->num_mgrs = min_t(u16, d->num_mgrs, ARRAY_SIZE(d->mgrs));
 	d->num_ovls = min_t(u16, d->num_ovls, ARRAY_SIZE(d->ovls));
@@ -248,9 +446,6 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 	memset(comp, 0, sizeof(comp));
 	memset(ovl_new_use_mask, 0, sizeof(ovl_new_use_mask));
 
-	if (skip || !dsscomp_is_any_device_active())
-		goto skip_comp;
-
 	d->mode = DSSCOMP_SETUP_DISPLAY;
 
 	/* mark managers we are using */
@@ -279,9 +474,54 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 			swap_rb_in_mgr_info(d->mgrs + i);
 	}
 
+	/*
+	 * Active managers left out of the composition are blanked below, so
+	 * they are locked along with the ones we set.  A composition without
+	 * managers blanks every display and locks all of them.
+	 */
+	lock_mask = dsscomp_gralloc_lock_mgrs(d->num_mgrs ? mgr_set_mask :
+					      (1 << MAX_MANAGERS) - 1);
+
+	/*
+	 * Queue the flip and check for blanking only with the manager locks
+	 * held.  A blank frame holds every manager lock, so a frame cannot
+	 * slip past it and re-enable a display after suspend, and flips are
+	 * queued in the order they are applied on each manager.
+	 */
+	mutex_lock(&mtx);
+	list_add_tail(&gsync->q, &flip_queue);
+	if (debug & DEBUG_GRALLOC_PHASES)
+		dev_info(DEV(cdev), "[%p] queuing flip\n", gsync);
+
+	log_event(0, ms, gsync, "new in %pf (refs=1)",
+			(u32)dsscomp_gralloc_queue, 0);
+
+	/* ignore frames while we are blanked */
+	skip = blanked;
+	if (skip && (debug & DEBUG_PHASES))
+		dev_info(DEV(cdev), "[%p,%08x] ignored\n", gsync, d->sync_id);
+
+	/* mark blank frame by NULL tiler pa pointer */
+	if (!skip && pas == NULL)
+		blanked = true;
+
+	mutex_unlock(&mtx);
+
+	if (skip || !dsscomp_is_any_device_active()) {
+		dsscomp_gralloc_unlock_mgrs(lock_mask);
+		goto skip_comp;
+	}
+
+	for (ch = 0; ch < MAX_MANAGERS; ch++)
+		if (lock_mask & (1 << ch))
+			log_event(20 * ch + 20, 0, gsync,
+				  "locked mgr%d after %d us", ch,
+				  (u32) ktime_us_delta(ktime_get(), start));
+
 	/* create dsscomp objects for set managers (including active ones) */
 	for (ch = 0; ch < MAX_MANAGERS; ch++) {
-		if (!(mgr_set_mask & (1 << ch)) && !ovl_use_mask[ch])
+		if (!(lock_mask & (1 << ch)) ||
+		    (!(mgr_set_mask & (1 << ch)) && !ovl_use_mask[ch]))
 			continue;
 
 		mgr = cdev->mgrs[ch];
@@ -389,16 +629,12 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 			goto skip_map1d;
 
 		if (!slot) {
-			if (down_timeout(&free_slots_sem,
-					msecs_to_jiffies(100))) {
+			slot = get_tiler_slot(gsync, pas[i]->mem[0]);
+			if (!slot) {
 				dev_warn(DEV(cdev), "could not obtain "
 							"tiler slot");
 				goto skip_buffer;
 			}
-			mutex_lock(&mtx);
-			slot = list_first_entry(&free_slots, typeof(*slot), q);
-			list_move(&slot->q, &gsync->slots);
-			mutex_unlock(&mtx);
 		}
 
 		size = oi->cfg.stride * oi->cfg.height;
@@ -418,8 +654,12 @@ int dsscomp_gralloc_queue(struct dsscomp_setup_dispc_data *d,
 			(oi->ba & ~PAGE_MASK);
 		if (oi->cfg.color_mode == OMAP_DSS_COLOR_NV12)
 			oi->uv = oi->ba + oi->cfg.stride * oi->cfg.height;
-		memcpy(slot->page_map + slot_used, pas[i]->mem,
-		       sizeof(*slot->page_map) * size);
+		if (memcmp(slot->page_map + slot_used, pas[i]->mem,
+			   sizeof(*slot->page_map) * size)) {
+			memcpy(slot->page_map + slot_used, pas[i]->mem,
+			       sizeof(*slot->page_map) * size);
+			slot_dirty = true;
+		}
 		slot_used += size;
 		goto skip_map1d;
 
@@ -438,13 +678,25 @@ skip_map1d:
 			ovl_set_mask |= 1 << oi->cfg.ix;
 	}
 
-	if (slot && slot_used) {
+	/* skip repinning if the slot already has these pages pinned */
+	if (slot && slot_used && (slot_dirty || slot_used > slot->pinned)) {
 		r = tiler_pin_phys(slot->block_handle, slot->page_map,
 						slot_used);
 		if (r)
 			dev_err(DEV(cdev), "failed to pin %d pages into"
 				" %d-pg slots (%d)\n", slot_used,
 				tiler1d_slot_size(cdev) >> PAGE_SHIFT, r);
+		slot->pinned = r ? 0 : slot_used;
+
+		mutex_lock(&mtx);
+		slot_stats.pins++;
+		slot_stats.pages_pinned += slot_used;
+		mutex_unlock(&mtx);
+	} else if (slot && slot_used) {
+		mutex_lock(&mtx);
+		slot_stats.pins_skipped++;
+		slot_stats.pages_reused += slot_used;
+		mutex_unlock(&mtx);
 	}
 
 	for (ch = 0; ch < MAX_MANAGERS; ch++) {
@@ -472,17 +724,23 @@ skip_map1d:
 				atomic_read(&gsync->refs), (u32) comp[ch]);
 
 		r = dsscomp_delayed_apply(comp[ch]);
-		if (r)
+		if (r) {
 			dev_err(DEV(cdev), "failed to apply comp (%d)\n", r);
-		else
+		} else {
+			mutex_lock(&mtx);
 			ovl_use_mask[ch] = ovl_new_use_mask[ch];
+			mutex_unlock(&mtx);
+		}
+
+		log_event(20 * ch + 20, 0, gsync, "queued on mgr%d in %d us",
+			  ch, (u32) ktime_us_delta(ktime_get(), start));
 	}
+
+	dsscomp_gralloc_unlock_mgrs(lock_mask);
 skip_comp:
 	/* release sync object ref - this completes unapplied compositions */
 	dsscomp_gralloc_cb(gsync, DSS_COMPLETION_RELEASED);
 
-	mutex_unlock(&local_mtx);
-
 	return r;
 }
 EXPORT_SYMBOL(dsscomp_gralloc_queue);
@@ -594,6 +852,22 @@ void dsscomp_dbg_gralloc(struct seq_file *s)
 	}
 	seq_printf(s, "\n");
 	mutex_unlock(&dbg_mtx);
+
+	mutex_lock(&mtx);
+	i = 0;
+	list_for_each_entry(t, &free_slots, q)
+		i++;
+	seq_printf(s, "TILER 1D SLOTS\n\n"
+		   "  slots=%u (free=%d peak=%u min=%d max=%d) of %u pages\n"
+		   "  grows=%u shrinks=%u waits=%u timeouts=%u\n"
+		   "  pins=%u (%llu pages) skipped=%u (%llu pages)\n\n",
+		   num_slots, i, slot_stats.peak, NUM_TILER1D_SLOTS,
+		   MAX_TILER1D_SLOTS, tiler1d_slot_size(cdev) >> PAGE_SHIFT,
+		   slot_stats.grows, slot_stats.shrinks, slot_stats.waits,
+		   slot_stats.timeouts, slot_stats.pins,
+		   slot_stats.pages_pinned, slot_stats.pins_skipped,
+		   slot_stats.pages_reused);
+	mutex_unlock(&mtx);
 #endif
 }
 
@@ -608,50 +882,44 @@ void dsscomp_gralloc_init(struct dsscomp_dev *cdev_)
 	if (!cdev) {
 		cdev = cdev_;
 
+		for (i = 0; i < MAX_MANAGERS; i++)
+			mutex_init(&mgr_mtx[i]);
+
 #ifdef CONFIG_HAS_EARLYSUSPEND
 		register_early_suspend(&early_suspend_info);
 #endif
 	}
 
-	if (!free_slots.next) {
-		INIT_LIST_HEAD(&free_slots);
-		for (i = 0; i < NUM_TILER1D_SLOTS; i++) {
-			struct tiler_block *block_handle =
-				tiler_reserve_1d(tiler1d_slot_size(cdev_));
-			if (IS_ERR_OR_NULL(block_handle)) {
-				pr_err("could not allocate tiler block\n");
-				break;
-			}
-			slots[i].block_handle = block_handle;
-			slots[i].phys = tiler_ssptr(block_handle);
-			slots[i].size =  tiler1d_slot_size(cdev_) >> PAGE_SHIFT;
-			slots[i].page_map = vmalloc(sizeof(*slots[i].page_map) *
-						slots[i].size);
-			if (!slots[i].page_map) {
-				pr_err("could not allocate page_map\n");
-				tiler_unpin(block_handle);
-				break;
-			}
-			list_add(&slots[i].q, &free_slots);
-			up(&free_slots_sem);
-		}
-		/* reset free_slots if no TILER memory could be reserved */
-		if (!i)
-			ZERO(free_slots);
+	/* reserve the minimum slots, the pool grows from there on demand */
+	mutex_lock(&mtx);
+	while (num_slots < NUM_TILER1D_SLOTS) {
+		struct tiler1d_slot *slot = alloc_tiler_slot();
+		if (!slot)
+			break;
+		list_add_tail(&slot->q, &free_slots);
+		num_slots++;
+		slot_stats.peak = max(slot_stats.peak, num_slots);
+		up(&free_slots_sem);
 	}
+	mutex_unlock(&mtx);
 }
 
 void dsscomp_gralloc_exit(void)
 {
-	struct tiler1d_slot *slot;
+	struct tiler1d_slot *slot, *slot_;
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	unregister_early_suspend(&early_suspend_info);
 #endif
 
-	list_for_each_entry(slot, &free_slots, q) {
-		vfree(slot->page_map);
-		tiler_unpin(slot->block_handle);
+	cancel_delayed_work_sync(&shrink_work);
+
+	mutex_lock(&mtx);
+	list_for_each_entry_safe(slot, slot_, &free_slots, q) {
+		list_del(&slot->q);
+		free_tiler_slot(slot);
+		num_slots--;
 	}
-	INIT_LIST_HEAD(&free_slots);
+	sema_init(&free_slots_sem, 0);
+	mutex_unlock(&mtx);
 }
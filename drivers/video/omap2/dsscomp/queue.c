@@ -44,6 +44,7 @@ struct maskref {
 
 static struct {
 	struct workqueue_struct *apply_workq;
+	struct mutex mtx;		/* serializes applies to this manager */
 
 	u32 ovl_mask;			/* overlays used on this display */
 	struct maskref ovl_qmask;	/* overlays queued to this display */
@@ -109,6 +110,8 @@ int dsscomp_queue_init(struct dsscomp_dev *cdev_)
 		return -EINVAL;
 
 	ZERO(mgrq);
+	for (i = 0; i < ARRAY_SIZE(mgrq); i++)
+		mutex_init(&mgrq[i].mtx);
 	for (i = 0; i < cdev->num_mgrs; i++) {
 		struct omap_overlay_manager *mgr;
 		mgrq[i].apply_workq =
@@ -581,7 +584,7 @@ skip_ovl_set:
 	if (!d->win.h && !d->win.y)
 		d->win.h = dssdev->panel.timings.y_res - d->win.y;
 
-	mutex_lock(&mtx);
+	mutex_lock(&mgrq[comp->ix].mtx);
 	if (mgrq[comp->ix].blanking) {
 		pr_info_ratelimited("ignoring apply mgr(%s) while blanking\n",
 				    mgr->name);
@@ -607,7 +610,7 @@ skip_ovl_set:
 			goto err;
 		}
 	}
-	mutex_unlock(&mtx);
+	mutex_unlock(&mgrq[comp->ix].mtx);
 
 	/*
 	 * TRICKY: try to unregister callback to see if callbacks have
@@ -638,7 +641,7 @@ skip_ovl_set:
 
 	return r;
 err:
-	mutex_unlock(&mtx);
+	mutex_unlock(&mgrq[comp->ix].mtx);
 done:
 	return r;
 }
@@ -655,14 +658,14 @@ int dsscomp_state_notifier(struct notifier_block *nb,
 	enum omap_dss_display_state state = arg;
 	struct omap_overlay_manager *mgr = dssdev->manager;
 	if (mgr) {
-		mutex_lock(&mtx);
+		mutex_lock(&mgrq[mgr->id].mtx);
 		if (state == OMAP_DSS_DISPLAY_DISABLED) {
 			mgr->blank(mgr, true);
 			mgrq[mgr->id].blanking = true;
 		} else if (state == OMAP_DSS_DISPLAY_ACTIVE) {
 			mgrq[mgr->id].blanking = false;
 		}
-		mutex_unlock(&mtx);
+		mutex_unlock(&mgrq[mgr->id].mtx);
 	}
 	return 0;
 }
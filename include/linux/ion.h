@@ -22,7 +22,7 @@
 struct ion_handle;
 /**
  * enum ion_heap_types - list of all possible types of heaps
- * @ION_HEAP_TYPE_SYSTEM:	 memory allocated via vmalloc
+ * @ION_HEAP_TYPE_SYSTEM:	 memory allocated from per-order page pools
  * @ION_HEAP_TYPE_SYSTEM_CONTIG: memory allocated via kmalloc
  * @ION_HEAP_TYPE_CARVEOUT:	 memory allocated from a prereserved
  * 				 carveout heap, allocations are physically
@@ -48,6 +48,7 @@ struct ion_heap;
 struct ion_mapper;
 struct ion_client;
 struct ion_buffer;
+struct dma_buf;
 
 /* This should be removed some day when phys_addr_t's are fully
    plumbed in the kernel, and all instances of ion_phys_addr_t should
@@ -219,9 +220,32 @@ struct ion_handle *ion_import(struct ion_client *client,
  * with them from userspace.  These buffers are represented by a file
  * descriptor obtained as the return from the ION_IOC_SHARE ioctl.
  * This function coverts that fd into the underlying buffer, and returns
- * the handle to use to refer to it further.
+ * the handle to use to refer to it further.  dma-buf fds exported by ion
+ * are accepted as well.
  */
 struct ion_handle *ion_import_fd(struct ion_client *client, int fd);
+
+/**
+ * ion_share_dma_buf() - export a handle as a dma-buf
+ * @client:	the client
+ * @handle:	the handle to export
+ *
+ * The dma-buf holds its own reference to the buffer, so the handle may be
+ * freed once this returns.  Importers get one sg_table per attachment,
+ * built by the heap, and cpu access is bracketed by the heap's cache
+ * maintenance.  Returns an ERR_PTR if the heap cannot export dma-bufs.
+ */
+struct dma_buf *ion_share_dma_buf(struct ion_client *client,
+				  struct ion_handle *handle);
+
+/**
+ * ion_share_dma_buf_fd() - export a handle as a dma-buf file descriptor
+ * @client:	the client
+ * @handle:	the handle to export
+ *
+ * Returns the fd, or a negative error.
+ */
+int ion_share_dma_buf_fd(struct ion_client *client, struct ion_handle *handle);
 #endif /* __KERNEL__ */
 
 /**
@@ -232,6 +256,16 @@ struct ion_handle *ion_import_fd(struct ion_client *client, int fd);
  *
  */
 
+/*
+ * Allocation flags.  The low bits of the flags select the heaps by id, the
+ * top bits are reserved for requests to the heap.
+ *
+ * ION_FLAG_ZEROED: the buffer must be returned zero filled.  The system
+ * heaps always zero their memory, the carveout heap starts zeroing freed
+ * memory in the background once this flag has been used on it.
+ */
+#define ION_FLAG_ZEROED		(1 << 31)
+
 /**
  * struct ion_allocation_data - metadata passed from userspace for allocations
  * @len:	size of the allocation
@@ -304,6 +338,41 @@ struct ion_cached_user_buf_data {
 	size_t size;
 };
 
+/**
+ * struct ion_cache_range - a byte range of a buffer
+ * @offset:	offset from the start of the buffer
+ * @len:	length of the range
+ */
+struct ion_cache_range {
+	size_t offset;
+	size_t len;
+};
+
+/* cache operations for ION_IOC_SYNC_CACHED */
+#define ION_CACHE_SYNC_CLEAN		0
+#define ION_CACHE_SYNC_INVALIDATE	1
+#define ION_CACHE_SYNC_FLUSH		2
+
+/* maximum number of ranges per ION_IOC_SYNC_CACHED */
+#define ION_CACHE_SYNC_MAX_RANGES	256
+
+/**
+ * struct ion_cache_sync_data - metadata passed from userspace for cache
+ * maintenance on parts of a handle that was mapped cacheable.
+ * @handle:	a handle
+ * @vaddr:	virtual address the handle is mapped at
+ * @op:		one of the ION_CACHE_SYNC_* operations
+ * @nr_ranges:	number of entries in ranges
+ * @ranges:	user pointer to the ranges to operate on
+ */
+struct ion_cache_sync_data {
+	struct ion_handle *handle;
+	unsigned long vaddr;
+	unsigned int op;
+	unsigned int nr_ranges;
+	struct ion_cache_range *ranges;
+};
+
 #define ION_IOC_MAGIC		'I'
 
 /**
@@ -365,4 +434,24 @@ struct ion_cached_user_buf_data {
 #define ION_IOC_INVAL_CACHED	_IOWR(ION_IOC_MAGIC, 8, \
 					struct ion_cached_user_buf_data)
 
+/**
+ * DOC: ION_IOC_SYNC_CACHED - cache maintenance on ranges of a buffer
+ *
+ * Takes an ion_cache_sync_data struct and cleans, invalidates or flushes
+ * only the listed ranges of a buffer mapped cacheable.  The kernel picks
+ * between range and whole-cache maintenance based on their measured cost.
+ */
+#define ION_IOC_SYNC_CACHED	_IOW(ION_IOC_MAGIC, 9, \
+					struct ion_cache_sync_data)
+
+/**
+ * DOC: ION_IOC_SHARE_DMABUF - export an allocation as a dma-buf
+ *
+ * Takes an ion_fd_data struct with the handle field populated with a valid
+ * opaque handle.  Returns the struct with the fd field set to a dma-buf file
+ * descriptor, which can be passed to any dma-buf importer, mmaped, or
+ * imported back into ion with ION_IOC_IMPORT.
+ */
+#define ION_IOC_SHARE_DMABUF	_IOWR(ION_IOC_MAGIC, 10, struct ion_fd_data)
+
 #endif /* _LINUX_ION_H */
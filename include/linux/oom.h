@@ -67,6 +67,33 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The Android low memory killer keeps thread group leaders in buckets by
+ * oom_score_adj. These keep the buckets in step with fork, exit, exec and
+ * oom_score_adj changes.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_task_add(struct task_struct *p);
+extern void lowmem_task_del(struct task_struct *p);
+extern void lowmem_task_replace(struct task_struct *old,
+				struct task_struct *new);
+extern void lowmem_adj_update(struct task_struct *task);
+#else
+static inline void lowmem_task_add(struct task_struct *p)
+{
+}
+static inline void lowmem_task_del(struct task_struct *p)
+{
+}
+static inline void lowmem_task_replace(struct task_struct *old,
+				       struct task_struct *new)
+{
+}
+static inline void lowmem_adj_update(struct task_struct *task)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -1318,6 +1318,9 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_node;	/* lowmemorykiller adj bucket */
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -22,6 +22,7 @@
 #include <linux/kobject.h>
 #include <linux/device.h>
 #include <linux/fb.h>
+#include <linux/ktime.h>
 #include <sound/asound.h>
 
 #define DISPC_IRQ_FRAMEDONE		(1 << 0)
@@ -352,6 +353,8 @@ int dsi_vc_dcs_write_nosync(struct omap_dss_device *dssdev, int channel,
 		u8 *data, int len);
 int dsi_vc_generic_write_nosync(struct omap_dss_device *dssdev, int channel,
 		u8 *data, int len);
+int dsi_vc_write_batch_begin(struct omap_dss_device *dssdev, int channel);
+int dsi_vc_write_batch_end(struct omap_dss_device *dssdev, int channel);
 int dsi_vc_dcs_read(struct omap_dss_device *dssdev, int channel, u8 dcs_cmd,
 		u8 *buf, int buflen);
 int dsi_vc_generic_read_0(struct omap_dss_device *dssdev, int channel, u8 *buf,
@@ -834,6 +837,11 @@ int omapdss_dsi_enable_te(struct omap_dss_device *dssdev, bool enable);
 
 int omap_dsi_update(struct omap_dss_device *dssdev, int channel,
 		void (*callback)(int, void *), void *data);
+int omap_dsi_prepare_update(struct omap_dss_device *dssdev, int channel,
+		void (*callback)(int, void *), void *data);
+void omap_dsi_start_update(struct omap_dss_device *dssdev, ktime_t te_stamp);
+unsigned omap_dsi_get_ulps_timeout(struct omap_dss_device *dssdev,
+		unsigned max_ms);
 int omap_dsi_request_vc(struct omap_dss_device *dssdev, int *channel);
 int omap_dsi_set_vc_id(struct omap_dss_device *dssdev, int channel, int vc_id);
 void omap_dsi_release_vc(struct omap_dss_device *dssdev, int channel);
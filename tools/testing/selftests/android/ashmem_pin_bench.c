@@ -0,0 +1,235 @@
+/*
+ * ashmem pin/unpin stress benchmark.
+ *
+ * Each thread maps an area, unpins every other page of it so that the area
+ * holds many unpinned ranges, and then unpins and pins again random pages
+ * of it in a loop.  With -S all threads share one area instead, and -P
+ * adds a thread that keeps purging all caches, which runs the shrinker
+ * against the pinning threads.
+ *
+ * Prints unpin/pin pairs per second, how often a pin found its range
+ * purged, and a latency histogram of the pairs.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../bench.h"
+#include "ashmem.h"
+
+
+static unsigned long iterations = 100000;
+static unsigned long nr_pages = 4096;
+static long page_size;
+static int shared_fd = -1;
+static volatile int stop_purge;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long done;
+	unsigned long purged;
+	unsigned long failed;
+	struct bench_hist hist;
+};
+
+static pthread_barrier_t start;
+
+/* create, map and dirty an area, then unpin every other page of it */
+static int create_area(void)
+{
+	size_t size = nr_pages * page_size;
+	struct ashmem_pin pin;
+	unsigned long i;
+	char *addr;
+	int fd;
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/ashmem");
+		exit(1);
+	}
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		perror("ASHMEM_SET_SIZE");
+		exit(1);
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memset(addr, 1, size);
+
+	for (i = 1; i < nr_pages; i += 2) {
+		pin.offset = i * page_size;
+		pin.len = page_size;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			perror("ASHMEM_UNPIN");
+			exit(1);
+		}
+	}
+	return fd;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long i;
+	int fd = shared_fd >= 0 ? shared_fd : create_area();
+
+	pthread_barrier_wait(&start);
+
+	for (i = 0; i < iterations; i++) {
+		unsigned long page = rand_r(&w->seed) % nr_pages;
+		unsigned long len = 1 + rand_r(&w->seed) % 4;
+		struct ashmem_pin pin;
+		unsigned long long t0, ns;
+		int ret;
+
+		if (page + len > nr_pages)
+			len = nr_pages - page;
+		pin.offset = page * page_size;
+		pin.len = len * page_size;
+
+		t0 = now_ns();
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			w->failed++;
+			continue;
+		}
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		ns = now_ns() - t0;
+		if (ret < 0) {
+			w->failed++;
+			continue;
+		}
+		if (ret == ASHMEM_WAS_PURGED)
+			w->purged++;
+
+		bench_hist_add(&w->hist, ns);
+		w->done++;
+	}
+
+	if (fd != shared_fd)
+		close(fd);
+	return NULL;
+}
+
+static void *purge_fn(void *arg)
+{
+	int fd = open("/dev/ashmem", O_RDWR);
+
+	(void)arg;
+	if (fd < 0) {
+		perror("open /dev/ashmem");
+		exit(1);
+	}
+	while (!stop_purge) {
+		ioctl(fd, ASHMEM_PURGE_ALL_CACHES);
+		usleep(1000);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t threads] [-n iterations] [-p pages] [-S] [-P]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_hist hist = { { 0 }, 0 };
+	unsigned long done = 0, purged = 0, failed = 0;
+	unsigned long long t0, elapsed;
+	struct worker *workers;
+	pthread_t purger;
+	int nr_threads = 4, shared = 0, purge = 0;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "t:n:p:SP")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			nr_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		case 'P':
+			purge = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads <= 0 || !nr_pages)
+		usage(argv[0]);
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (shared)
+		shared_fd = create_area();
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_barrier_init(&start, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].seed = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	if (purge && pthread_create(&purger, NULL, purge_fn, NULL)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - t0;
+
+	stop_purge = 1;
+	if (purge)
+		pthread_join(purger, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		done += workers[i].done;
+		purged += workers[i].purged;
+		failed += workers[i].failed;
+		bench_hist_merge(&hist, &workers[i].hist);
+	}
+
+	printf("%d threads, %s, %lu pages per area%s\n", nr_threads,
+	       shared ? "one shared area" : "one area each", nr_pages,
+	       purge ? ", purging" : "");
+	printf("%lu unpin/pin pairs in %llu ms: %llu pairs/s, %lu purged, %lu failed\n",
+	       done, elapsed / 1000000,
+	       elapsed ? done * 1000000000ULL / elapsed : 0, purged, failed);
+	bench_hist_print("unpin+pin", &hist);
+
+	free(workers);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,422 @@
+/*
+ * Multi-process binder IPC benchmark.
+ *
+ * Forks a context manager, then nr_pairs independent server processes and
+ * one client process per server.  Servers register with the context
+ * manager, clients look up their own server through it and then send
+ * synchronous transactions of a fixed size.  Since the pairs share nothing
+ * but the driver, their throughput shows how much unrelated IPC is
+ * serialized inside binder.
+ *
+ * Needs CONFIG_ANDROID_BINDER_IPC and no other context manager, so it runs
+ * under a generic x86 kernel but not on a booted Android system.  Prints
+ * transactions per second and a round trip latency histogram.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../bench.h"
+#include "binder.h"
+
+#define MAP_SIZE	(1024 * 1024)
+#define MAX_PAIRS	64
+
+/*
+ * codes understood by the context manager: REGISTER carries a struct
+ * registration, LOOKUP a slot and is answered with the handle registered
+ * for it, if any
+ */
+#define CODE_REGISTER	1
+#define CODE_LOOKUP	2
+
+struct registration {
+	struct flat_binder_object obj;	/* at offset 0, objects are aligned */
+	uint32_t slot;
+};
+
+static int nr_pairs = 4;
+static unsigned long iterations = 10000;
+static size_t payload = 128;
+
+struct result {
+	unsigned long done;
+	struct bench_hist hist;
+	unsigned long long elapsed_ns;
+};
+
+struct bctx {
+	int fd;
+	unsigned char out[256];
+	size_t out_len;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void bopen(struct bctx *b)
+{
+	struct binder_version version;
+
+	b->fd = open("/dev/binder", O_RDWR);
+	if (b->fd < 0)
+		die("open /dev/binder");
+	if (ioctl(b->fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		exit(1);
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0) ==
+	    MAP_FAILED)
+		die("mmap /dev/binder");
+	b->out_len = 0;
+}
+
+/* queue a command, sent with the next bflush() or bwait() */
+static void bcmd(struct bctx *b, uint32_t cmd, const void *arg, size_t len)
+{
+	if (b->out_len + sizeof(cmd) + len > sizeof(b->out)) {
+		fprintf(stderr, "command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(b->out + b->out_len, &cmd, sizeof(cmd));
+	if (len)
+		memcpy(b->out + b->out_len + sizeof(cmd), arg, len);
+	b->out_len += sizeof(cmd) + len;
+}
+
+static void bflush(struct bctx *b)
+{
+	struct binder_write_read bwr = {
+		.write_size = b->out_len,
+		.write_buffer = (unsigned long)b->out,
+	};
+
+	if (b->out_len && ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ");
+	b->out_len = 0;
+}
+
+static void bfree(struct bctx *b, const struct binder_transaction_data *txn)
+{
+	const void *buffer = txn->data.ptr.buffer;
+
+	bcmd(b, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+/* keep a handle received in a buffer once the buffer is freed */
+static void bacquire(struct bctx *b, uint32_t handle)
+{
+	bcmd(b, BC_ACQUIRE, &handle, sizeof(handle));
+}
+
+/*
+ * Send the queued commands and read until a transaction or reply comes
+ * in, answering reference count requests on the way.  Returns the
+ * BR_ code and fills in txn.
+ */
+static uint32_t bwait(struct bctx *b, struct binder_transaction_data *txn)
+{
+	unsigned char in[512];
+
+	for (;;) {
+		struct binder_write_read bwr = {
+			.write_size = b->out_len,
+			.write_buffer = (unsigned long)b->out,
+			.read_size = sizeof(in),
+			.read_buffer = (unsigned long)in,
+		};
+		unsigned char *p = in, *end;
+
+		if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("BINDER_WRITE_READ");
+		}
+		b->out_len = 0;
+		end = in + bwr.read_consumed;
+
+		while (p + sizeof(uint32_t) <= end) {
+			uint32_t cmd;
+			struct binder_ptr_cookie pc;
+
+			memcpy(&cmd, p, sizeof(cmd));
+			p += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, p, sizeof(*txn));
+				return cmd;
+			case BR_INCREFS:
+				memcpy(&pc, p, sizeof(pc));
+				bcmd(b, BC_INCREFS_DONE, &pc, sizeof(pc));
+				break;
+			case BR_ACQUIRE:
+				memcpy(&pc, p, sizeof(pc));
+				bcmd(b, BC_ACQUIRE_DONE, &pc, sizeof(pc));
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+			case BR_ERROR:
+				fprintf(stderr, "transaction failed (%#x)\n",
+					cmd);
+				exit(1);
+			}
+			p += _IOC_SIZE(cmd);
+		}
+	}
+}
+
+/*
+ * send a transaction or reply carrying data and, if has_obj, one object at
+ * the start of the data
+ */
+static void bsend(struct bctx *b, uint32_t cmd, uint32_t handle,
+		  uint32_t code, const void *data, size_t len, int has_obj)
+{
+	static size_t offset;
+	struct binder_transaction_data txn = {
+		.code = code,
+		.data_size = len,
+		.offsets_size = has_obj ? sizeof(size_t) : 0,
+	};
+
+	txn.target.handle = handle;
+	txn.data.ptr.buffer = data;
+	txn.data.ptr.offsets = &offset;
+	bcmd(b, cmd, &txn, sizeof(txn));
+}
+
+static void manager(void)
+{
+	uint32_t handles[MAX_PAIRS] = { 0 };
+	struct binder_transaction_data txn;
+	struct bctx b;
+
+	bopen(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	bcmd(&b, BC_ENTER_LOOPER, NULL, 0);
+
+	for (;;) {
+		struct flat_binder_object obj;
+
+		if (bwait(&b, &txn) != BR_TRANSACTION)
+			continue;
+		memset(&obj, 0, sizeof(obj));
+
+		if (txn.code == CODE_REGISTER) {
+			const struct registration *reg = txn.data.ptr.buffer;
+
+			if (reg->slot < MAX_PAIRS) {
+				handles[reg->slot] = reg->obj.handle;
+				bacquire(&b, reg->obj.handle);
+			}
+		} else if (txn.code == CODE_LOOKUP) {
+			const uint32_t *slot = txn.data.ptr.buffer;
+
+			if (*slot < MAX_PAIRS && handles[*slot]) {
+				obj.type = BINDER_TYPE_HANDLE;
+				obj.handle = handles[*slot];
+			}
+		}
+		bfree(&b, &txn);
+		bsend(&b, BC_REPLY, 0, 0, &obj, sizeof(obj),
+		      obj.type == BINDER_TYPE_HANDLE);
+		bflush(&b);
+	}
+}
+
+static void server(uint32_t slot)
+{
+	static int object;
+	struct binder_transaction_data txn;
+	struct registration reg;
+	char *reply = calloc(1, payload);
+	struct bctx b;
+
+	if (!reply)
+		die("calloc");
+	bopen(&b);
+	bcmd(&b, BC_ENTER_LOOPER, NULL, 0);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.slot = slot;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.binder = &object;
+	reg.obj.cookie = &object;
+	bsend(&b, BC_TRANSACTION, 0, CODE_REGISTER, &reg, sizeof(reg), 1);
+	while (bwait(&b, &txn) != BR_REPLY)
+		;
+	bfree(&b, &txn);
+
+	for (;;) {
+		if (bwait(&b, &txn) != BR_TRANSACTION)
+			continue;
+		bfree(&b, &txn);
+		bsend(&b, BC_REPLY, 0, 0, reply, payload, 0);
+		bflush(&b);
+	}
+}
+
+static uint32_t lookup(struct bctx *b, uint32_t slot)
+{
+	struct binder_transaction_data txn;
+
+	for (;;) {
+		const struct flat_binder_object *obj;
+
+		bsend(b, BC_TRANSACTION, 0, CODE_LOOKUP, &slot, sizeof(slot),
+		      0);
+		while (bwait(b, &txn) != BR_REPLY)
+			;
+		obj = txn.data.ptr.buffer;
+		if (obj->type == BINDER_TYPE_HANDLE) {
+			uint32_t handle = obj->handle;
+
+			bacquire(b, handle);
+			bfree(b, &txn);
+			bflush(b);
+			return handle;
+		}
+		bfree(b, &txn);
+		bflush(b);
+		usleep(1000);
+	}
+}
+
+static void client(uint32_t slot, int start_fd, int result_fd)
+{
+	struct binder_transaction_data txn;
+	struct result res;
+	char *request = calloc(1, payload);
+	unsigned long i;
+	uint32_t handle;
+	struct bctx b;
+	char go;
+
+	if (!request)
+		die("calloc");
+	memset(&res, 0, sizeof(res));
+	bopen(&b);
+	handle = lookup(&b, slot);
+
+	if (read(start_fd, &go, 1) != 1)
+		die("read start");
+
+	res.elapsed_ns = now_ns();
+	for (i = 0; i < iterations; i++) {
+		unsigned long long t0 = now_ns(), ns;
+
+		bsend(&b, BC_TRANSACTION, handle, 1, request, payload, 0);
+		while (bwait(&b, &txn) != BR_REPLY)
+			;
+		bfree(&b, &txn);
+		ns = now_ns() - t0;
+
+		bench_hist_add(&res.hist, ns);
+		res.done++;
+	}
+	bflush(&b);
+	res.elapsed_ns = now_ns() - res.elapsed_ns;
+
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		die("write result");
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p pairs] [-n iterations] [-s size]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t pids[2 * MAX_PAIRS + 1];
+	struct bench_hist hist = { { 0 }, 0 };
+	unsigned long long elapsed_ns = 0;
+	unsigned long done = 0;
+	int start_pipe[2], result_pipe[2];
+	int nr_pids = 0, i, opt;
+
+	while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_pairs <= 0 || nr_pairs > MAX_PAIRS || !payload ||
+	    payload > MAP_SIZE / 4)
+		usage(argv[0]);
+
+	if (pipe(start_pipe) || pipe(result_pipe))
+		die("pipe");
+
+	pids[nr_pids] = fork();
+	if (!pids[nr_pids])
+		manager();
+	nr_pids++;
+	/* let the manager claim the context before anyone looks it up */
+	usleep(100000);
+
+	for (i = 0; i < nr_pairs; i++) {
+		pids[nr_pids] = fork();
+		if (!pids[nr_pids])
+			server(i);
+		nr_pids++;
+		pids[nr_pids] = fork();
+		if (!pids[nr_pids])
+			client(i, start_pipe[0], result_pipe[1]);
+		nr_pids++;
+	}
+
+	for (i = 0; i < nr_pairs; i++)
+		if (write(start_pipe[1], "g", 1) != 1)
+			die("write start");
+
+	for (i = 0; i < nr_pairs; i++) {
+		struct result res;
+
+		if (read(result_pipe[0], &res, sizeof(res)) != sizeof(res))
+			die("read result");
+		done += res.done;
+		bench_hist_merge(&hist, &res.hist);
+		if (res.elapsed_ns > elapsed_ns)
+			elapsed_ns = res.elapsed_ns;
+	}
+
+	for (i = 0; i < nr_pids; i++)
+		kill(pids[i], SIGTERM);
+	while (wait(NULL) > 0)
+		;
+
+	printf("%d pairs, %zu byte transactions\n", nr_pairs, payload);
+	printf("%lu transactions in %llu ms: %llu transactions/s\n", done,
+	       elapsed_ns / 1000000,
+	       elapsed_ns ? done * 1000000000ULL / elapsed_ns : 0);
+	bench_hist_print("round trip", &hist);
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Multi-threaded logger write benchmark.
+ *
+ * Each writer thread logs lines of a fixed size the way liblog does, with
+ * one writev() of priority, tag and message per line.  Optional reader
+ * threads keep draining the log meanwhile, so that the cost readers add to
+ * writers shows up too.
+ *
+ * Prints lines per second and a write latency histogram.  The log is
+ * /dev/log/main on Android and /dev/log_main with devtmpfs; -d picks
+ * another one.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../bench.h"
+#include "logger.h"
+
+
+static const char *device;
+static unsigned long iterations = 100000;
+static size_t msg_len = 64;
+static volatile int stop_readers;
+
+struct writer {
+	pthread_t thread;
+	unsigned long done;
+	unsigned long failed;
+	struct bench_hist hist;
+};
+
+static pthread_barrier_t start;
+
+static int open_log(int flags)
+{
+	int fd = open(device, flags);
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	return fd;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	char tag[] = "logger_bench";
+	char *msg = malloc(msg_len);
+	struct iovec iov[3];
+	unsigned long i;
+	int fd;
+
+	if (!msg) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msg_len - 1);
+	msg[msg_len - 1] = '\0';
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = msg_len;
+
+	fd = open_log(O_WRONLY);
+	pthread_barrier_wait(&start);
+
+	for (i = 0; i < iterations; i++) {
+		unsigned long long t0 = now_ns(), ns;
+
+		if (writev(fd, iov, 3) < 0) {
+			w->failed++;
+			continue;
+		}
+		ns = now_ns() - t0;
+
+		bench_hist_add(&w->hist, ns);
+		w->done++;
+	}
+
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	char buf[LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)];
+	int fd = open_log(O_RDONLY | O_NONBLOCK);
+
+	(void)arg;
+	while (!stop_readers) {
+		if (read(fd, buf, sizeof(buf)) < 0 && errno == EAGAIN)
+			usleep(1000);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t writers] [-r readers] [-n lines] [-s size]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_hist hist = { { 0 }, 0 };
+	unsigned long done = 0, failed = 0;
+	unsigned long long t0, elapsed;
+	struct writer *writers;
+	pthread_t *readers;
+	int nr_writers = 4, nr_readers = 0;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "d:t:r:n:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			nr_writers = atoi(optarg);
+			break;
+		case 'r':
+			nr_readers = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			msg_len = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_writers <= 0 || nr_readers < 0 || !msg_len ||
+	    msg_len > LOGGER_ENTRY_MAX_PAYLOAD - 16)
+		usage(argv[0]);
+	if (!device)
+		device = access("/dev/log/main", W_OK) ? "/dev/log_main" :
+							 "/dev/log/main";
+
+	writers = calloc(nr_writers, sizeof(*writers));
+	readers = calloc(nr_readers + 1, sizeof(*readers));
+	if (!writers || !readers) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_barrier_init(&start, NULL, nr_writers + 1);
+
+	for (i = 0; i < nr_readers; i++)
+		if (pthread_create(&readers[i], NULL, reader_fn, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+	for (i = 0; i < nr_writers; i++)
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	for (i = 0; i < nr_writers; i++)
+		pthread_join(writers[i].thread, NULL);
+	elapsed = now_ns() - t0;
+
+	stop_readers = 1;
+	for (i = 0; i < nr_readers; i++)
+		pthread_join(readers[i], NULL);
+
+	for (i = 0; i < nr_writers; i++) {
+		done += writers[i].done;
+		failed += writers[i].failed;
+		bench_hist_merge(&hist, &writers[i].hist);
+	}
+
+	printf("%s: %d writers, %d readers, %zu byte messages\n", device,
+	       nr_writers, nr_readers, msg_len);
+	printf("%lu lines in %llu ms: %llu lines/s, %lu failed\n", done,
+	       elapsed / 1000000,
+	       elapsed ? done * 1000000000ULL / elapsed : 0, failed);
+	bench_hist_print("write", &hist);
+
+	free(readers);
+	free(writers);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Timing and latency histograms shared by the selftest benchmarks.
+ *
+ * Each worker adds the latency of its operations to its own bench_hist,
+ * which main() merges into one and prints when all workers are done.
+ */
+#ifndef _SELFTESTS_BENCH_H
+#define _SELFTESTS_BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+
+/* power of 4 microsecond buckets, the last one catches everything above */
+#define NR_BUCKETS	10
+
+struct bench_hist {
+	unsigned long count[NR_BUCKETS];
+	unsigned long long max_ns;
+};
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_hist_add(struct bench_hist *h,
+				  unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int i;
+
+	for (i = 0; i < NR_BUCKETS - 1 && us >= 4; i++)
+		us /= 4;
+	h->count[i]++;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+static inline void bench_hist_merge(struct bench_hist *h,
+				    const struct bench_hist *from)
+{
+	int i;
+
+	for (i = 0; i < NR_BUCKETS; i++)
+		h->count[i] += from->count[i];
+	if (from->max_ns > h->max_ns)
+		h->max_ns = from->max_ns;
+}
+
+static inline void bench_hist_print(const char *what,
+				    const struct bench_hist *h)
+{
+	int i;
+
+	printf("%s latency (max %llu us):\n", what, h->max_ns / 1000);
+	for (i = 0; i < NR_BUCKETS; i++) {
+		if (i < NR_BUCKETS - 1)
+			printf("  < %8lu us: %lu\n", 4UL << (2 * i),
+			       h->count[i]);
+		else
+			printf("  >=%8lu us: %lu\n", 4UL << (2 * (i - 1)),
+			       h->count[i]);
+	}
+}
+
+#endif /* _SELFTESTS_BENCH_H */
@@ -0,0 +1,182 @@
+/*
+ * Multi-threaded ion allocation benchmark.
+ *
+ * Each thread opens its own ion client and allocates and frees buffers
+ * in a loop.  Threads are spread round robin over the heap masks given
+ * with -m, so running one mask measures contention inside a heap and
+ * several masks measure how well allocations from different heaps proceed
+ * in parallel.  The default heap is id 0, the system heap, which stands
+ * in for the slower carveout and tiler heaps so that the numbers reflect
+ * ion's own locking rather than the heap allocator.
+ *
+ * Prints allocations per second and a latency histogram for the
+ * allocate + free pair.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../bench.h"
+
+/* from include/linux/ion.h */
+struct ion_handle;
+
+struct ion_allocation_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	struct ion_handle *handle;
+};
+
+struct ion_handle_data {
+	struct ion_handle *handle;
+};
+
+#define ION_IOC_MAGIC		'I'
+#define ION_IOC_ALLOC		_IOWR(ION_IOC_MAGIC, 0, \
+				      struct ion_allocation_data)
+#define ION_IOC_FREE		_IOWR(ION_IOC_MAGIC, 1, struct ion_handle_data)
+
+#define MAX_MASKS	8
+
+static size_t size = 4096;
+static unsigned long iterations = 10000;
+static unsigned int masks[MAX_MASKS];
+static int nr_masks;
+
+struct worker {
+	pthread_t thread;
+	unsigned int mask;
+	unsigned long done;
+	unsigned long failed;
+	struct bench_hist hist;
+};
+
+static pthread_barrier_t start;
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long i;
+	int fd;
+
+	fd = open("/dev/ion", O_RDWR);
+	if (fd < 0) {
+		perror("open /dev/ion");
+		exit(1);
+	}
+
+	pthread_barrier_wait(&start);
+
+	for (i = 0; i < iterations; i++) {
+		struct ion_allocation_data alloc = {
+			.len = size,
+			.align = 0,
+			.flags = w->mask,
+		};
+		struct ion_handle_data free_data;
+		unsigned long long t0, ns;
+
+		t0 = now_ns();
+		if (ioctl(fd, ION_IOC_ALLOC, &alloc) < 0) {
+			w->failed++;
+			continue;
+		}
+		free_data.handle = alloc.handle;
+		ioctl(fd, ION_IOC_FREE, &free_data);
+		ns = now_ns() - t0;
+
+		bench_hist_add(&w->hist, ns);
+		w->done++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t threads] [-n iterations] [-s size] [-m heap_mask]...\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_hist hist = { { 0 }, 0 };
+	unsigned long done = 0, failed = 0;
+	unsigned long long t0, elapsed;
+	struct worker *workers;
+	int nr_threads = 4;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "t:n:s:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (nr_masks == MAX_MASKS)
+				usage(argv[0]);
+			masks[nr_masks++] = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads <= 0 || !size)
+		usage(argv[0]);
+	if (!nr_masks)
+		masks[nr_masks++] = 1 << 0;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_barrier_init(&start, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].mask = masks[i % nr_masks];
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - t0;
+
+	for (i = 0; i < nr_threads; i++) {
+		done += workers[i].done;
+		failed += workers[i].failed;
+		bench_hist_merge(&hist, &workers[i].hist);
+	}
+
+	printf("%d threads, %d heap masks, %zu byte buffers\n",
+	       nr_threads, nr_masks, size);
+	printf("%lu allocations in %llu ms: %llu allocs/s, %lu failed\n",
+	       done, elapsed / 1000000,
+	       elapsed ? done * 1000000000ULL / elapsed : 0, failed);
+	bench_hist_print("alloc+free", &hist);
+
+	free(workers);
+	return failed ? 1 : 0;
+}